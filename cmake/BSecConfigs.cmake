@@ -0,0 +1,64 @@
+# Embed the BSEC configurations of a directory in a target, as read-only data selected at runtime.
+#
+# Every <dir>/<anything>iaq_<profile>/bsec_iaq.txt (the comma separated bytes of the Bosch
+# releases) becomes a profile named <profile>, "33v_3s_4d" for instance. The sample period in the
+# name (3s or 300s) gives the BSEC sample rate the configuration was made for.
+function(bsec_embed_configs TARGET CONFIG_DIR)
+    file(GLOB config_files LIST_DIRECTORIES false "${CONFIG_DIR}/*/bsec_iaq.txt")
+    list(SORT config_files)
+    set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS ${config_files})
+
+    set(blobs "")
+    set(profiles "")
+    set(names "")
+    foreach(config_file IN LISTS config_files)
+        get_filename_component(config_dir "${config_file}" DIRECTORY)
+        get_filename_component(dir_name "${config_dir}" NAME)
+        string(REGEX REPLACE "^.*iaq_" "" name "${dir_name}")
+        if(name IN_LIST names)
+            message(STATUS "BSEC configuration ${name}: ${dir_name} ignored, already embedded")
+            continue()
+        endif()
+
+        file(READ "${config_file}" bytes)
+        string(REGEX REPLACE "[ \t\r\n]" "" bytes "${bytes}")
+        string(REGEX REPLACE ",$" "" bytes "${bytes}")
+        if(NOT bytes MATCHES "^[0-9]+(,[0-9]+)*$")
+            message(FATAL_ERROR "${config_file} is not a list of comma separated bytes")
+        endif()
+        string(REGEX MATCHALL "[0-9]+" byte_list "${bytes}")
+        list(LENGTH byte_list length)
+
+        if(name MATCHES "_300s_")
+            set(sample_rate BSEC_SAMPLE_RATE_ULP)
+        elseif(name MATCHES "_3s_")
+            set(sample_rate BSEC_SAMPLE_RATE_LP)
+        else()
+            message(WARNING "BSEC configuration ${name}: unknown sample period, using the LP sample rate")
+            set(sample_rate BSEC_SAMPLE_RATE_LP)
+        endif()
+
+        string(MAKE_C_IDENTIFIER "bsec_config_${name}" symbol)
+        string(APPEND blobs "static constexpr uint8_t ${symbol}[${length}] = {${bytes}};\n")
+        string(APPEND profiles "    {\"${name}\", ${sample_rate}, ${symbol}, sizeof(${symbol})},\n")
+        list(APPEND names "${name}")
+        message(STATUS "BSEC configuration ${name}: ${length} bytes")
+    endforeach()
+    if(NOT names)
+        message(FATAL_ERROR "No BSEC configuration in ${CONFIG_DIR}")
+    endif()
+    list(LENGTH names count)
+
+    set(output "${CMAKE_CURRENT_BINARY_DIR}/generated/bsec_configs.cpp")
+    file(CONFIGURE OUTPUT "${output}" CONTENT "// Generated by cmake/BSecConfigs.cmake from ${CONFIG_DIR}, do not edit
+
+#include \"bsec_config_profile.h\"
+
+${blobs}
+const BSecConfigProfile bsecConfigProfiles[] = {
+${profiles}};
+
+const size_t bsecConfigProfileCount = ${count};
+")
+    target_sources(${TARGET} PRIVATE "${output}")
+endfunction()
@@ -19,6 +19,17 @@
 #include <iostream>
 #include "homebridge_service.h"
 #include "air_quality_service.h"
+#include "bsec_config_profile.h"
+#include "simulated_bme68x_bus.h"
+#include "i2c_transaction_log.h"
+#include "i2c_bus_worker.h"
+#include "simple_i2c_bus.h"
+#include "monotonic_clock.h"
+#include "sample_rate_policy.h"
+#include "sampling_scheduler.h"
+#include "shutdown_signal.h"
+#include "virtual_clock.h"
+#include <vector>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include "spdlog/sinks/rotating_file_sink.h"
@@ -28,30 +39,215 @@ using namespace std;
 
 void create_default_logger() {
     std::vector<spdlog::sink_ptr> sinks;
-    sinks.push_back(std::make_shared<spdlog::sinks::stdout_color_sink_st>());
+    sinks.push_back(std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
     // Create a file rotating logger with 5mb size max and 3 rotated files.
-    auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_st>("logs/log", 1048576 * 5, 3);
+    auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>("logs/log", 1048576 * 5, 3);
     file_sink->set_level(spdlog::level::debug);
     sinks.push_back(file_sink);
     auto combined_logger = std::make_shared<spdlog::logger>("default", begin(sinks), end(sinks));
     spdlog::set_default_logger(combined_logger);
 }
 
-int main(int, char**) {
+// --sensor <name>:<address>[:<mux channel>], the address in hexadecimal (0x77 for instance)
+bool parse_sensor(const string& spec, AirQualityServiceConfig& config) {
+    size_t first = spec.find(':');
+    if (first == string::npos || first == 0) {
+        spdlog::error("Invalid sensor {}: expected <name>:<i2c address>[:<mux channel>]", spec);
+        return false;
+    }
+    size_t second = spec.find(':', first + 1);
+    string addressSpec = spec.substr(first + 1, second - first - 1);
+    string channelSpec = (second == string::npos) ? "" : spec.substr(second + 1);
+    unsigned long address = 0;
+    try {
+        size_t end = 0;
+        address = stoul(addressSpec, &end, 0);
+        if (end != addressSpec.size()) {
+            throw invalid_argument(addressSpec);
+        }
+    } catch (exception& e) {
+        spdlog::error("Invalid i2c address in {}: {}", spec, addressSpec);
+        return false;
+    }
+    // 7-bit addressing only
+    if (address > 0x7F) {
+        spdlog::error("Invalid i2c address in {}: {} (0x00-0x7F)", spec, addressSpec);
+        return false;
+    }
+    config.name = spec.substr(0, first);
+    config.address = (uint8_t)address;
+    config.muxChannel = IAQ_I2C_MUX_CHANNEL;
+    if (second != string::npos) {
+        try {
+            size_t end = 0;
+            config.muxChannel = stoi(channelSpec, &end, 0);
+            if (end != channelSpec.size()) {
+                throw invalid_argument(channelSpec);
+            }
+        } catch (exception& e) {
+            spdlog::error("Invalid multiplexer channel in {}: {}", spec, channelSpec);
+            return false;
+        }
+    }
+    if (config.muxChannel != I2C_BUS_NO_MUX_CHANNEL && (config.muxChannel < 0 || config.muxChannel >= I2C_BUS_MUX_CHANNELS)) {
+        spdlog::error("Invalid multiplexer channel in {}: {} (0-{})", spec, config.muxChannel, I2C_BUS_MUX_CHANNELS - 1);
+        return false;
+    }
+    config.stateFile = string(IAQ_SAVED_STATE_DIR) + "/" + IAQ_SAVED_STATE_FILE + "_" + config.name;
+    return true;
+}
+
+int main(int argc, char** argv) {
     create_default_logger();
     spdlog::set_level(spdlog::level::info);
+    // before any thread is created: they all inherit the blocked signals
+    ShutdownSignal shutdownSignal;
+
+    bool simulate = false;
+    bool virtualTime = false;
+    double duration = 0;
+    bool spi = IAQ_SENSOR_SPI;
+    bool ratePolicy = IAQ_RATE_POLICY;
+    string recordFile;
+    string replayFile;
+    string bsecConfig = IAQ_BSEC_CONFIG;
+    vector<AirQualityServiceConfig> sensors;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        AirQualityServiceConfig sensor;
+        if (arg == "--simulate") {
+            simulate = true;
+        } else if (arg == "--virtual-time") {
+            virtualTime = true;
+        } else if (arg == "--duration" && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        } else if (arg == "--rate-policy") {
+            ratePolicy = true;
+        } else if (arg == "--spi") {
+            spi = true;
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (arg == "--bsec-config" && i + 1 < argc) {
+            bsecConfig = argv[++i];
+        } else if (arg == "--sensor" && i + 1 < argc && parse_sensor(argv[++i], sensor)) {
+            // the name keys the saved state, the record file and the accessory of each sensor
+            for (auto& other : sensors) {
+                if (other.name == sensor.name) {
+                    spdlog::error("Duplicate sensor name: {}", sensor.name);
+                    return 1;
+                }
+            }
+            sensors.push_back(sensor);
+        } else {
+            spdlog::error("Unknown option: {}", arg);
+            spdlog::info("Usage: {} [--simulate | --replay <file>] [--virtual-time] [--duration <seconds>] [--rate-policy] [--spi] [--record <file>] [--bsec-config <name>] [--sensor <name>:<i2c address>[:<mux channel>]]...", argv[0]);
+            spdlog::info("BSEC configurations: {}", bsecConfigProfileNames());
+            return 1;
+        }
+    }
+    if (sensors.empty()) {
+        sensors.push_back(AirQualityServiceConfig{IAQ_SENSOR_NAME, string(IAQ_SAVED_STATE_DIR) + "/" + IAQ_SAVED_STATE_FILE,
+            SensorBusInterface::I2C, IAQ_I2C_ADDRESS, IAQ_I2C_MUX_CHANNEL, IAQ_BSEC_CONFIG});
+    }
+    if (findBSecConfigProfile(bsecConfig) == nullptr) {
+        spdlog::error("Unknown BSEC configuration: {} (available: {})", bsecConfig, bsecConfigProfileNames());
+        return 1;
+    }
+    for (auto& sensor : sensors) {
+        sensor.interface = spi ? SensorBusInterface::SPI : SensorBusInterface::I2C;
+        sensor.bsecConfig = bsecConfig;
+        // a BSEC state only restores with the configuration it was saved with
+        if (bsecConfig != IAQ_BSEC_CONFIG) {
+            sensor.stateFile += "." + bsecConfig;
+        }
+        // simulated or replayed sensors must not overwrite the state learned from the real ones
+        if (simulate) {
+            sensor.stateFile += ".simulated";
+        } else if (!replayFile.empty()) {
+            sensor.stateFile += ".replay";
+        }
+    }
+    if (sensors.size() > 1 && (spi || !replayFile.empty())) {
+        spdlog::error("Several sensors can only be monitored on the I2C bus (or simulated)");
+        return 1;
+    }
+    if (virtualTime && !simulate && replayFile.empty()) {
+        spdlog::error("The virtual time can only be used with a simulated or replayed sensor");
+        return 1;
+    }
+
+    // The virtual time runs as fast as the sampling steps can be computed
+    unique_ptr<SamplingClock> clock;
+    if (virtualTime) {
+        spdlog::info("Using the virtual time");
+        clock = make_unique<VirtualClock>(MonotonicClock().nowNs());
+    } else {
+        clock = make_unique<MonotonicClock>();
+    }
 
     spdlog::info("Init Homebridge service");
-    HomeBridgeService homebridgeService(HomeBridgeServiceConfig{HOMEBRIDGE_URL, HOMEBRIDGE_PUBLISH_INTERVAL});
+    HomeBridgeService homebridgeService(HomeBridgeServiceConfig{HOMEBRIDGE_URL, HOMEBRIDGE_PUBLISH_INTERVAL, HOMEBRIDGE_TIMEOUT});
     homebridgeService.start();
 
-    AirQualityService* airQualityService = AirQualityService::sharedInstance();
-    airQualityService->setOnAirQualityChange([&](AirQuality airQuality) {
-        spdlog::info("Air quality changed: iaq={} (accuracy: {}),temperature={}, pressure={}, humidity={} co2={}, bVOC={}, gas={}",
-            airQuality.iaq, airQuality.iaq_accuracy, airQuality.temperature, airQuality.pressure, airQuality.humidity, airQuality.co2, airQuality.bVOC, airQuality.gas_percentage);
+    // Sensors on the real I2C bus share its adapter (and its multiplexer)
+    unique_ptr<SimpleI2CBus> i2cBus;
+    unique_ptr<I2CBusWorker> busWorker;
+    if (sensors.size() > 1 && !simulate) {
+        i2cBus = make_unique<SimpleI2CBus>();
+        if (i2cBus->openI2CBus(IAQ_I2C_BUS_DEVICE) < 0) {
+            spdlog::error("Failed to open the i2c bus");
+            return 1;
+        }
+        i2cBus->setMultiplexerAddress(IAQ_I2C_MUX_ADDRESS);
+        if (IAQ_I2C_BUS_WORKER) {
+            busWorker = make_unique<I2CBusWorker>(i2cBus.get());
+            busWorker->start();
+        }
+    }
 
-            homebridgeService.update("rpi4temperature", airQuality.temperature - IAQ_TEMP_OFFSET);
-            homebridgeService.update("rpi4humidity", airQuality.humidity);
+    vector<unique_ptr<AirQualityService>> services;
+    for (size_t i = 0; i < sensors.size(); ++i) {
+        auto service = make_unique<AirQualityService>(sensors[i]);
+        AirQualityService *airQualityService = service.get();
+        if (simulate) {
+            spdlog::info("Using a simulated BME68x sensor for {}", sensors[i].name);
+            SimulatedBME68xConfig config;
+            config.spi = spi;
+            config.seed += i;
+            SamplingClock *sensorClock = clock.get();
+            airQualityService->setSensorBus(make_unique<SimulatedBME68xBus>(config, [sensorClock]() {
+                return sensorClock->nowNs() / 1000;
+            }));
+        } else if (!replayFile.empty()) {
+            spdlog::info("Replaying the sensor transactions of {}", replayFile);
+            airQualityService->setSensorBus(make_unique<I2CReplayBus>(replayFile, [airQualityService]() {
+                // the replay is over once the log is exhausted
+                airQualityService->stop();
+            }));
+        } else if (busWorker) {
+            airQualityService->setSensorBus(busWorker->attachDevice(sensors[i].address, sensors[i].muxChannel));
+        } else if (i2cBus) {
+            airQualityService->setSensorBus(i2cBus->attachDevice(sensors[i].address, sensors[i].muxChannel));
+        }
+        if (ratePolicy) {
+            airQualityService->setSampleRatePolicy(make_unique<SampleRatePolicy>(SampleRatePolicyConfig{IAQ_RATE_LP_START_HOUR,
+                IAQ_RATE_LP_END_HOUR, IAQ_RATE_VOLATILITY, IAQ_RATE_VOLATILITY_WINDOW, IAQ_RATE_CALM_DELAY}));
+        }
+        if (!recordFile.empty()) {
+            airQualityService->setTransactionLogFile(sensors.size() > 1 ? recordFile + "." + sensors[i].name : recordFile);
+        }
+        string name = sensors[i].name;
+        airQualityService->subscribe(AirQualitySubscription{"log", AIR_QUALITY_ALL_FIELDS, 0, [name](AirQuality airQuality) {
+            spdlog::info("Air quality changed ({}): iaq={} (accuracy: {}),temperature={}, pressure={}, humidity={} co2={}, bVOC={}, gas={}", name,
+                airQuality.iaq, airQuality.iaq_accuracy, airQuality.temperature, airQuality.pressure, airQuality.humidity, airQuality.co2, airQuality.bVOC, airQuality.gas_percentage);
+        }});
+        // HomeBridgeService keeps the latest values and publishes them every HOMEBRIDGE_PUBLISH_INTERVAL by itself
+        airQualityService->subscribe(AirQualitySubscription{"homebridge", AIR_QUALITY_TEMPERATURE | AIR_QUALITY_HUMIDITY | AIR_QUALITY_IAQ,
+            0, [&homebridgeService, name](AirQuality airQuality) {
+            homebridgeService.update(name + "temperature", airQuality.temperature - IAQ_TEMP_OFFSET);
+            homebridgeService.update(name + "humidity", airQuality.humidity);
 
             float homebridgeIaq;
             if (airQuality.iaq_accuracy < 2) {
@@ -67,10 +263,28 @@ int main(int, char**) {
             } else {
                 homebridgeIaq = 5;
             }
-            homebridgeService.update("rpi4iaq", homebridgeIaq);
-    });
-    airQualityService->monitor();
+            homebridgeService.update(name + "iaq", homebridgeIaq);
+        }});
+        services.push_back(std::move(service));
+    }
+
+    // Each sensor has its own BSEC instance, their sampling steps are spread over a pool of workers
+    SamplingScheduler scheduler(*clock, IAQ_SAMPLING_WORKERS);
+    for (auto& service : services) {
+        scheduler.add(service.get());
+    }
+    if (duration > 0) {
+        scheduler.stopAt(clock->nowNs() + (int64_t)(duration * 1000000000.0));
+    }
+    // SIGTERM / SIGINT stop the sampling: the services save their state and drain their subscribers,
+    // then HomeBridge publishes the last values
+    shutdownSignal.start([&scheduler]() {
+        scheduler.stop();
+    }, IAQ_SHUTDOWN_TIMEOUT);
+    scheduler.run();
+    services.clear();
     homebridgeService.stop();
+    shutdownSignal.stop();
 
     spdlog::info("program ended.");
 }
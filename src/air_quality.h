@@ -0,0 +1,48 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AIR_QUALITY_H_
+#define AIR_QUALITY_H_
+
+#include <cstdint>
+
+struct AirQuality {
+    float iaq;
+    int iaq_accuracy;
+    float temperature;
+    float pressure;
+    float humidity;
+    float co2;
+    float bVOC;
+    float gas_percentage;
+    int64_t timestampNs;                // time of the measurement (sampling clock)
+};
+
+/// @brief Fields of AirQuality, to subscribe to the changes of some of them only
+enum AirQualityField: uint32_t {
+    AIR_QUALITY_IAQ = 1 << 0,           // iaq and iaq_accuracy
+    AIR_QUALITY_TEMPERATURE = 1 << 1,
+    AIR_QUALITY_PRESSURE = 1 << 2,
+    AIR_QUALITY_HUMIDITY = 1 << 3,
+    AIR_QUALITY_CO2 = 1 << 4,
+    AIR_QUALITY_BVOC = 1 << 5,
+    AIR_QUALITY_GAS_PERCENTAGE = 1 << 6,
+    AIR_QUALITY_ALL_FIELDS = (1 << 7) - 1
+};
+
+#endif // AIR_QUALITY_H_
@@ -0,0 +1,111 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "air_quality_dispatcher.h"
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+AirQualityDispatcher::AirQualityDispatcher(const std::string& name, std::function<void(AirQuality)> consumer)
+    : name(name), consumer(consumer), running(false) {
+    eventFd = eventfd(0, EFD_CLOEXEC);
+    if (eventFd < 0) {
+        spdlog::error("[AirQualityDispatcher] {}: Failed to create the eventfd: {}", name, strerror(errno));
+    }
+}
+
+AirQualityDispatcher::~AirQualityDispatcher() {
+    stop();
+    if (eventFd >= 0) {
+        close(eventFd);
+    }
+}
+
+void AirQualityDispatcher::start() {
+    if (running || eventFd < 0) {
+        return;
+    }
+    running = true;
+    consumerThread = thread([this]() {
+        spdlog::debug("[AirQualityDispatcher] {}: started", this->name);
+        run();
+        spdlog::debug("[AirQualityDispatcher] {}: stopped", this->name);
+    });
+}
+
+void AirQualityDispatcher::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    uint64_t wakeup = 1;
+    if (write(eventFd, &wakeup, sizeof(wakeup)) < 0) {
+        spdlog::error("[AirQualityDispatcher] {}: Failed to wake the consumer up: {}", name, strerror(errno));
+    }
+    if (consumerThread.joinable()) {
+        consumerThread.join();
+    }
+}
+
+bool AirQualityDispatcher::publish(const AirQuality& airQuality) {
+    if (!ring.push(airQuality)) {
+        return false;
+    }
+    // the eventfd counter wakes the consumer up without any lock shared with it
+    uint64_t wakeup = 1;
+    return write(eventFd, &wakeup, sizeof(wakeup)) == sizeof(wakeup);
+}
+
+uint64_t AirQualityDispatcher::dropped() {
+    return ring.dropped();
+}
+
+/**********************************************************************************************************************/
+/* AirQualityDispatcher Private Implementation */
+/**********************************************************************************************************************/
+
+void AirQualityDispatcher::run() {
+    uint64_t reportedDrops = 0;
+    while (running) {
+        uint64_t count;
+        if (read(eventFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            spdlog::error("[AirQualityDispatcher] {}: Failed to wait for the samples: {}", name, strerror(errno));
+            break;
+        }
+        drain();
+
+        // drops are reported here, the sampling thread doesn't log
+        uint64_t drops = ring.dropped();
+        if (drops != reportedDrops) {
+            spdlog::warn("[AirQualityDispatcher] {}: consumer too slow, {} samples dropped ({} in total)", name, drops - reportedDrops, drops);
+            reportedDrops = drops;
+        }
+    }
+    drain();
+}
+
+void AirQualityDispatcher::drain() {
+    AirQuality airQuality;
+    while (ring.pop(airQuality)) {
+        consumer(airQuality);
+    }
+}
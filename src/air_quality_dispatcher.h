@@ -0,0 +1,71 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AIR_QUALITY_DISPATCHER_H_
+#define AIR_QUALITY_DISPATCHER_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include "air_quality.h"
+#include "spsc_ring.h"
+
+#define AIR_QUALITY_DISPATCHER_CAPACITY 64  // samples waiting for the consumer before new ones are dropped
+
+/*
+    Hands air quality samples over to a thread of their own, which runs a consumer callback
+    (logs, HomeBridge...). The sampling thread only pushes to a lock-free ring and signals an
+    eventfd: a slow consumer loses samples but never delays a measurement.
+*/
+
+class AirQualityDispatcher {
+private:
+    std::string name;
+    std::function<void(AirQuality)> consumer;
+    SpscRing<AirQuality, AIR_QUALITY_DISPATCHER_CAPACITY> ring;
+    int eventFd;
+    std::atomic<bool> running;
+    std::thread consumerThread;
+
+    void run();
+    void drain();
+
+public:
+    /// @brief Create a dispatcher
+    /// @param name name of the sensor and consumer, used in the logs
+    /// @param consumer called with every sample, on the dispatcher thread
+    AirQualityDispatcher(const std::string& name, std::function<void(AirQuality)> consumer);
+    ~AirQualityDispatcher();
+    AirQualityDispatcher(const AirQualityDispatcher&) = delete;
+    void operator=(const AirQualityDispatcher&) = delete;
+
+    void start();
+
+    /// @brief Stop the thread once the samples already pushed are consumed
+    void stop();
+
+    /// @brief Queue a sample for the consumer (from the sampling thread, never blocks)
+    /// @return false if the ring was full and the sample dropped
+    bool publish(const AirQuality& airQuality);
+
+    /// @brief Number of samples dropped because the consumer was behind
+    uint64_t dropped();
+};
+
+#endif // AIR_QUALITY_DISPATCHER_H_
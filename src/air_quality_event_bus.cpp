@@ -0,0 +1,122 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "air_quality_event_bus.h"
+#include <spdlog/spdlog.h>
+#include "air_quality_dispatcher.h"
+
+AirQualityEventBus::AirQualityEventBus(const std::string& name): name(name) {
+}
+
+AirQualityEventBus::~AirQualityEventBus() {
+    stop();
+}
+
+void AirQualityEventBus::subscribe(AirQualitySubscription subscription) {
+    auto subscriber = std::make_unique<Subscriber>();
+    subscriber->dispatcher = std::make_unique<AirQualityDispatcher>(name + "/" + subscription.name, subscription.callback);
+    subscriber->subscription = subscription;
+    subscriber->delivered = false;
+    subscriber->last = AirQuality{};
+    subscriber->pending = false;
+    subscriber->latest = AirQuality{};
+    spdlog::debug("[AirQualityEventBus] {}: {} subscribed (fields: {:#x}, interval: {} ms)", name, subscription.name,
+        subscription.fields, subscription.minIntervalNs / 1000000);
+    subscribers.push_back(std::move(subscriber));
+}
+
+void AirQualityEventBus::start() {
+    for (auto& subscriber : subscribers) {
+        subscriber->dispatcher->start();
+    }
+}
+
+void AirQualityEventBus::stop() {
+    for (auto& subscriber : subscribers) {
+        // the last values must reach the subscriber even if its interval isn't over
+        if (subscriber->pending && subscriber->dispatcher->publish(subscriber->latest)) {
+            subscriber->last = subscriber->latest;
+        }
+        subscriber->pending = false;
+        subscriber->dispatcher->stop();
+    }
+}
+
+void AirQualityEventBus::publish(const AirQuality& airQuality) {
+    for (auto& subscriber : subscribers) {
+        const AirQualitySubscription& subscription = subscriber->subscription;
+        if (subscriber->delivered) {
+            bool changed = (changes(subscriber->last, airQuality) & subscription.fields) != 0;
+            if (airQuality.timestampNs - subscriber->last.timestampNs < subscription.minIntervalNs) {
+                // kept for the end of the interval: the subscriber must not miss the latest values
+                if (changed) {
+                    subscriber->pending = true;
+                    subscriber->latest = airQuality;
+                }
+                continue;
+            }
+            // once the interval is over, the latest sample supersedes the one held back
+            if (!changed && !subscriber->pending) {
+                continue;
+            }
+        }
+        if (subscriber->dispatcher->publish(airQuality)) {
+            subscriber->delivered = true;
+            subscriber->last = airQuality;
+            subscriber->pending = false;
+        }
+    }
+}
+
+uint64_t AirQualityEventBus::dropped() {
+    uint64_t drops = 0;
+    for (auto& subscriber : subscribers) {
+        drops += subscriber->dispatcher->dropped();
+    }
+    return drops;
+}
+
+/**********************************************************************************************************************/
+/* AirQualityEventBus Private Implementation */
+/**********************************************************************************************************************/
+
+uint32_t AirQualityEventBus::changes(const AirQuality& previous, const AirQuality& current) {
+    uint32_t fields = 0;
+    if (previous.iaq != current.iaq || previous.iaq_accuracy != current.iaq_accuracy) {
+        fields |= AIR_QUALITY_IAQ;
+    }
+    if (previous.temperature != current.temperature) {
+        fields |= AIR_QUALITY_TEMPERATURE;
+    }
+    if (previous.pressure != current.pressure) {
+        fields |= AIR_QUALITY_PRESSURE;
+    }
+    if (previous.humidity != current.humidity) {
+        fields |= AIR_QUALITY_HUMIDITY;
+    }
+    if (previous.co2 != current.co2) {
+        fields |= AIR_QUALITY_CO2;
+    }
+    if (previous.bVOC != current.bVOC) {
+        fields |= AIR_QUALITY_BVOC;
+    }
+    if (previous.gas_percentage != current.gas_percentage) {
+        fields |= AIR_QUALITY_GAS_PERCENTAGE;
+    }
+    return fields;
+}
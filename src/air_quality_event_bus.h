@@ -0,0 +1,86 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AIR_QUALITY_EVENT_BUS_H_
+#define AIR_QUALITY_EVENT_BUS_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "air_quality.h"
+
+class AirQualityDispatcher;
+
+struct AirQualitySubscription {
+    std::string name;                           // subscriber name, used in the logs
+    uint32_t fields;                            // AirQualityField mask: a sample is delivered when one of them changed
+    int64_t minIntervalNs;                      // minimum time between two delivered samples (0: every one), the latest
+                                                // sample held back is delivered once the interval is over
+    std::function<void(AirQuality)> callback;   // called on the thread of the subscriber
+};
+
+/*
+    Publication of the air quality samples of a sensor to any number of subscribers.
+    Every subscriber has its own queue and thread (AirQualityDispatcher): a slow one only
+    delays (or loses) its own samples. The filters are applied on publication, so the
+    samples a subscriber doesn't want are not even queued.
+*/
+
+class AirQualityEventBus {
+private:
+    struct Subscriber {
+        AirQualitySubscription subscription;
+        std::unique_ptr<AirQualityDispatcher> dispatcher;
+        bool delivered;                         // a sample was already delivered
+        AirQuality last;                        // last delivered sample
+        bool pending;                           // a sample was held back by the interval
+        AirQuality latest;                      // latest sample held back
+    };
+
+    std::string name;
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+
+    static uint32_t changes(const AirQuality& previous, const AirQuality& current);
+
+public:
+    /// @brief Create a bus
+    /// @param name name of the sensor, used in the logs
+    AirQualityEventBus(const std::string& name);
+    ~AirQualityEventBus();
+    AirQualityEventBus(const AirQualityEventBus&) = delete;
+    void operator=(const AirQualityEventBus&) = delete;
+
+    /// @brief Add a subscriber (must be called before start)
+    void subscribe(AirQualitySubscription subscription);
+
+    /// @brief Start the threads of the subscribers
+    void start();
+
+    /// @brief Stop the threads of the subscribers once their queued and held back samples are consumed
+    void stop();
+
+    /// @brief Queue a sample for the subscribers whose filters it passes (from the sampling thread, never blocks)
+    void publish(const AirQuality& airQuality);
+
+    /// @brief Total number of samples dropped because a subscriber was behind
+    uint64_t dropped();
+};
+
+#endif // AIR_QUALITY_EVENT_BUS_H_
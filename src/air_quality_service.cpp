@@ -21,18 +21,34 @@
 #include <spdlog/spdlog.h>
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
 #include <chrono>
-#include <thread>
 #include <unistd.h>
 #include <time.h>
-#include "bsec_integration.h"
+#include "bme68x.h"
+#include "bsec_interface_multi.h"
+#include "bsec_config_profile.h"
+#include "bsec_sensor.h"
 #include <sys/time.h>
 #include "constants.h"
+#include "simple_i2c_bus.h"
+#include "simple_spi_bus.h"
+#include "i2c_bus_worker.h"
+#include "i2c_transaction_log.h"
+#include "monotonic_clock.h"
+#include "sample_rate_policy.h"
+#include "sensor_bus_policy.h"
+#include "simulated_bme68x_bus.h"
 
 namespace fs = std::filesystem;
 using namespace std;
 
-#define I2C_BUS_ADDRESS BME68X_I2C_ADDR_HIGH 
+static MonotonicClock monotonicClock;   // time of the services not given a clock
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
 
 #pragma pack(push, 1)
 struct BSECSerializedState {
@@ -57,12 +73,17 @@ public:
     * param[in]        reg_addr        register address
     * param[in]        reg_data_ptr    pointer to the data to be written
     * param[in]        data_len        number of bytes to be written
-    * param[in]        intf_ptr        interface pointer
+    * param[in]        intf_ptr        context of the sensor (AirQualityService::SensorContext)
     *
     * @return          result of the bus communication function
     */
-    static int8_t bsec_i2c_register_write(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len, void *intf_ptr) {
-        int8_t ret = AirQualityService::sharedInstance()->writeI2CRegister(reg_addr, reg_data_ptr, data_len);
+    template <typename Bus>
+    static int8_t bsec_register_write(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len, void *intf_ptr) {
+        // intf_ptr is the context of the sensor: no lookup nor lock on the register path
+        auto *context = static_cast<AirQualityService::SensorContext*>(intf_ptr);
+        auto start = std::chrono::steady_clock::now();
+        int8_t ret = SensorBusPolicy<Bus>::write(*static_cast<Bus*>(context->bus), reg_addr, reg_data_ptr, data_len);
+        context->busTimeNs += elapsedNs(start);
         return (ret < 0) ? BME68X_E_COM_FAIL : BME68X_OK;
     }
 
@@ -72,22 +93,50 @@ public:
     * param[in]        reg_addr        register address
     * param[out]       reg_data_ptr    pointer to the memory to be used to store the read data
     * param[in]        data_len        number of bytes to be read
-    * param[in]        intf_ptr        interface pointer
+    * param[in]        intf_ptr        context of the sensor (AirQualityService::SensorContext)
     * 
     * @return          result of the bus communication function
     */
-    static int8_t bsec_i2c_register_read(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len, void *intf_ptr) {
-        int8_t ret = AirQualityService::sharedInstance()->readI2CRegister(reg_addr, reg_data_ptr, data_len);
+    template <typename Bus>
+    static int8_t bsec_register_read(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len, void *intf_ptr) {
+        auto *context = static_cast<AirQualityService::SensorContext*>(intf_ptr);
+        auto start = std::chrono::steady_clock::now();
+        int8_t ret = SensorBusPolicy<Bus>::read(*static_cast<Bus*>(context->bus), reg_addr, reg_data_ptr, data_len);
+        context->busTimeNs += elapsedNs(start);
         return (ret < 0) ? BME68X_E_COM_FAIL : BME68X_OK; 
     }
 
     /*!
-    * @brief           Capture the system time in microseconds
+    * @brief           Select the read/write operations matching the concrete type of the bus
     *
-    * @return          system_current_time    current system timestamp in microseconds
+    * @param[in]       bus      the sensor bus
+    * @param[out]      read     read operation to give to the driver
+    * @param[out]      write    write operation to give to the driver
+    *
+    * @return          none
     */
-    static int64_t bsec_get_timestamp_us() {
-        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    static void bind_bus(SensorBus *bus, bme68x_read_fptr_t *read, bme68x_write_fptr_t *write) {
+        bool bound = bind_bus_as<I2CDevice>(bus, "I2C", read, write)
+            || bind_bus_as<AsyncI2CDevice>(bus, "asynchronous I2C", read, write)
+            || bind_bus_as<SimpleSPIBus>(bus, "SPI", read, write)
+            || bind_bus_as<SimulatedBME68xBus>(bus, "simulated", read, write)
+            || bind_bus_as<I2CReplayBus>(bus, "replay", read, write)
+            || bind_bus_as<I2CTransactionRecorder>(bus, "recorder", read, write);
+        if (!bound) {
+            // unknown bus type: virtual calls
+            bind_bus_as<SensorBus>(bus, "generic", read, write);
+        }
+    }
+
+    template <typename Bus>
+    static bool bind_bus_as(SensorBus *bus, const char *name, bme68x_read_fptr_t *read, bme68x_write_fptr_t *write) {
+        if (dynamic_cast<Bus*>(bus) == nullptr) {
+            return false;
+        }
+        spdlog::debug("[BSecProxy] using the {} bus operations", name);
+        *read = bsec_register_read<Bus>;
+        *write = bsec_register_write<Bus>;
+        return true;
     }
 
     /*!
@@ -99,59 +148,116 @@ public:
     * @return          none
     */
     static void bsec_sleep_n(uint32_t t_us, void *intf_ptr) {
-        std::this_thread::sleep_for(std::chrono::microseconds(t_us));
+        SamplingClock *clock = static_cast<AirQualityService::SensorContext*>(intf_ptr)->service->clock;
+        clock->sleepUntilNs(clock->nowNs() + (int64_t)t_us * 1000);
     }
 
     /*!
     * @brief           Handling of the ready outputs
     *
-    * @param[in]       outputs               	output_t structure
-    * @param[in]       bsec_status             value returned by the bsec_do_steps() call
+    * @param[in]       service                 the service of the sensor
+    * @param[in]       outputs                 outputs of the bsec_do_steps() call
+    * @param[in]       n_outputs               number of outputs
     *
     * @return          none
     */
-    static void bsec_output_ready(output_t *outputs, bsec_library_return_t bsec_status) {
-    if (bsec_status == BSEC_OK) {
-        AirQualityService::sharedInstance()->onAirQualityChange(AirQuality {
-            .iaq = outputs->iaq,
-            .iaq_accuracy = outputs->iaq_accuracy,
-            .temperature = outputs->temperature,
-            .pressure = outputs->raw_pressure,
-            .humidity = outputs->humidity,
-            .co2 = outputs->co2_equivalent,
-            .bVOC = outputs->breath_voc_equivalent,
-            .gas_percentage = outputs->gas_percentage
-        });
-    } else {
-        spdlog::debug("[BSecProxy] output_ready: bsec_status: {}", bsec_status);
+    static void bsec_output_ready(AirQualityService *service, const bsec_output_t *outputs, uint8_t n_outputs) {
+    AirQuality& airQuality = service->airQuality;
+    for (uint8_t i = 0; i < n_outputs; ++i) {
+        switch (outputs[i].sensor_id) {
+            case BSEC_OUTPUT_IAQ:
+                airQuality.iaq = outputs[i].signal;
+                airQuality.iaq_accuracy = outputs[i].accuracy;
+                break;
+            case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE:
+                airQuality.temperature = outputs[i].signal;
+                break;
+            case BSEC_OUTPUT_RAW_PRESSURE:
+                airQuality.pressure = outputs[i].signal;
+                break;
+            case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY:
+                airQuality.humidity = outputs[i].signal;
+                break;
+            case BSEC_OUTPUT_CO2_EQUIVALENT:
+                airQuality.co2 = outputs[i].signal;
+                break;
+            case BSEC_OUTPUT_BREATH_VOC_EQUIVALENT:
+                airQuality.bVOC = outputs[i].signal;
+                break;
+            case BSEC_OUTPUT_GAS_PERCENTAGE:
+                airQuality.gas_percentage = outputs[i].signal;
+                break;
+        }
+    }
+    // the first outputs after a restore carry the accuracy of the saved state
+    if (service->savedAccuracy < 0) {
+        service->savedAccuracy = airQuality.iaq_accuracy;
+    }
+    if (service->ratePolicy) {
+        service->wantedSampleRate = service->ratePolicy->update(airQuality);
+    }
+    // the subscribers run on their own threads: they can't hold up the sampling
+    airQuality.timestampNs = (n_outputs > 0) ? outputs[0].time_stamp : service->timestampNs();
+    service->events.publish(airQuality);
+    if (spdlog::should_log(spdlog::level::debug)) {
+        RegisterShadowStats shadowStats = service->bus->registerShadow().stats();
+        spdlog::debug("[BSecProxy] {}: register shadow: write hits={} misses={}, read hits={} misses={}", service->config.name,
+            shadowStats.writeHits, shadowStats.writeMisses, shadowStats.readHits, shadowStats.readMisses);
+        BusStatsSnapshot busStats = service->busStatistics();
+        spdlog::debug("[BSecProxy] {}: bus: reads={} p50={}us p99={}us max={}us, writes={} p50={}us p99={}us max={}us, closes={} reopens={} mux switches={}", service->config.name,
+            busStats.reads.latency.count, busStats.reads.latency.percentileUs(50), busStats.reads.latency.percentileUs(99), busStats.reads.latency.maxUs,
+            busStats.writes.latency.count, busStats.writes.latency.percentileUs(50), busStats.writes.latency.percentileUs(99), busStats.writes.latency.maxUs,
+            busStats.closes, busStats.reopens, busStats.muxSwitches);
+        service->logSamplingStatistics(spdlog::level::debug);
     }
     }
 
     /*!
     * @brief           Load previous library state from non-volatile memory
     *
+    * @param[in]       store           the state store of the sensor
     * @param[in,out]   state_buffer    buffer to hold the loaded state string
     * @param[in]       n_buffer        size of the allocated state buffer
     *
     * @return          number of bytes copied to state_buffer
     */
-    static uint32_t bsec_state_load(uint8_t *state_buffer, uint32_t n_buffer) {
-        spdlog::info("[BSecProxy] BSec restore state...");
+    static uint32_t bsec_state_load(StateStore& store, uint8_t *state_buffer, uint32_t n_buffer) {
+        spdlog::info("[BSecProxy] BSec restore state from {}...", store.filePath());
 
         // Here we will load a state string from a previous use of BSEC
+        uint32_t length = store.load(state_buffer, n_buffer);
+        if (length == 0) {
+            length = bsec_legacy_state_load(store.filePath(), state_buffer, n_buffer);
+        }
+        return length;
+    }
+
+    /*!
+    * @brief           Load a state saved before the state store (raw BSECSerializedState), not to lose its calibration
+    *
+    * @param[in]       file_path       the state file
+    * @param[in,out]   state_buffer    buffer to hold the loaded state string
+    * @param[in]       n_buffer        size of the allocated state buffer
+    *
+    * @return          number of bytes copied to state_buffer
+    */
+    static uint32_t bsec_legacy_state_load(const string& file_path, uint8_t *state_buffer, uint32_t n_buffer) {
         fstream bsec_state_file;
-        string file_path = string(IAQ_SAVED_STATE_DIR) + "/" + IAQ_SAVED_STATE_FILE;
         if (!fs::exists(file_path)) {
             spdlog::debug("[BSecProxy] State file does not exist");
             return 0;
         }
+        BSECSerializedState state;
         bsec_state_file.open(file_path, ios::in | ios::binary);
-        char bufferRead[sizeof(BSECSerializedState)];
-        bsec_state_file.read(bufferRead, sizeof(bufferRead));
+        bsec_state_file.read(reinterpret_cast<char*>(&state), sizeof(BSECSerializedState));
+        bool complete = bsec_state_file.gcount() == sizeof(BSECSerializedState);
         bsec_state_file.close();
 
-        BSECSerializedState state;
-        memcpy(&state, bufferRead, sizeof(BSECSerializedState));
+        if (!complete || state.n_serialized_state == 0 || state.n_serialized_state > n_buffer) {
+            spdlog::error("[BSecProxy] Invalid state file");
+            return 0;
+        }
+        spdlog::info("[BSecProxy] Loaded a state file of the previous format");
         memcpy(state_buffer, state.serialized_state, state.n_serialized_state);
         return state.n_serialized_state;
     }
@@ -159,46 +265,43 @@ public:
     /*!
     * @brief           Save library state to non-volatile memory
     *
+    * @param[in]       store           the state store of the sensor
     * @param[in]       state_buffer    buffer holding the state to be stored
     * @param[in]       length          length of the state string to be stored
     *
-    * @return          none
+    * @return          0, STATE_STORE_UNCHANGED, or -1 if the state couldn't be written
     */
-    static void bsec_state_save(const uint8_t *state_buffer, uint32_t length) {
-        spdlog::info("[BSecProxy] BSec save state...");
-
-        BSECSerializedState state;
-        state.n_serialized_state = length;
-        memcpy(state.serialized_state, state_buffer, length * sizeof(uint8_t));
-
-        if (!fs::exists(IAQ_SAVED_STATE_DIR)) {
-            spdlog::debug("[BSecProxy] State folder does not exist");
-            fs::create_directory(IAQ_SAVED_STATE_DIR);
+    static int bsec_state_save(StateStore& store, const uint8_t *state_buffer, uint32_t length) {
+        int ret = store.save(state_buffer, length);
+        if (ret == STATE_STORE_UNCHANGED) {
+            spdlog::debug("[BSecProxy] BSec state unchanged, {} not rewritten", store.filePath());
+        } else if (ret < 0) {
+            spdlog::error("[BSecProxy] The state could not be saved, the previous one is kept");
+        } else {
+            spdlog::info("[BSecProxy] BSec state saved to {}", store.filePath());
         }
-
-        fstream bsec_state_file;
-        string file_path = string(IAQ_SAVED_STATE_DIR) + "/" + IAQ_SAVED_STATE_FILE;
-        bsec_state_file.open(file_path, ios::out | ios::binary);
-        bsec_state_file.write(reinterpret_cast<char*>(&state), sizeof(BSECSerializedState));
-        bsec_state_file.close();
+        return ret;
     }
     
     /*!
-    * @brief           Load library config from non-volatile memory
+    * @brief           Find a library config embedded at build time (bsec/config)
     *
-    * @param[in,out]   config_buffer    buffer to hold the loaded state string
-    * @param[in]       n_buffer        size of the allocated state buffer
+    * @param[in]       name            name of the config, "33v_3s_4d" for instance
     *
-    * @return          number of bytes copied to config_buffer
+    * @return          the config, nullptr if there is none with this name or it is too large for BSEC
     */
-    static uint32_t bsec_config_load(uint8_t *config_buffer, uint32_t n_buffer) {
-        spdlog::info("[BSecProxy] BSec restore config...");
-        // 33v 3s 4d
-        const uint8_t bsec_config_iaq[2063] = 
-            {2,0,5,2,189,1,0,0,0,0,0,0,247,7,0,0,176,0,1,0,0,192,168,71,64,49,119,76,0,0,97,69,0,0,97,69,137,65,0,191,205,204,204,190,0,0,64,191,225,122,148,190,10,0,3,0,0,0,96,64,23,183,209,56,0,0,0,0,0,0,0,0,0,0,0,0,205,204,204,189,0,0,0,0,0,0,0,0,0,0,128,63,0,0,0,0,0,0,128,63,0,0,0,0,0,0,0,0,0,0,128,63,0,0,0,0,0,0,128,63,0,0,0,0,0,0,0,0,0,0,128,63,0,0,0,0,0,0,128,63,82,73,157,188,95,41,203,61,118,224,108,63,155,230,125,63,191,14,124,63,0,0,160,65,0,0,32,66,0,0,160,65,0,0,32,66,0,0,32,66,0,0,160,65,0,0,32,66,0,0,160,65,8,0,2,0,0,0,72,66,16,0,3,0,10,215,163,60,10,215,35,59,10,215,35,59,13,0,5,0,0,0,0,0,100,35,41,29,86,88,0,9,0,229,208,34,62,0,0,0,0,0,0,0,0,218,27,156,62,225,11,67,64,0,0,160,64,0,0,0,0,0,0,0,0,94,75,72,189,93,254,159,64,66,62,160,191,0,0,0,0,0,0,0,0,33,31,180,190,138,176,97,64,65,241,99,190,0,0,0,0,0,0,0,0,167,121,71,61,165,189,41,192,184,30,189,64,12,0,10,0,0,0,0,0,0,0,0,0,45,5,11,0,1,1,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,10,10,4,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,128,63,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,145,1,254,0,2,1,5,48,117,100,0,44,1,112,23,151,7,132,3,197,0,92,4,144,1,64,1,64,1,144,1,48,117,48,117,48,117,48,117,100,0,100,0,100,0,48,117,48,117,48,117,100,0,100,0,48,117,48,117,8,7,8,7,8,7,8,7,8,7,8,7,8,7,8,7,8,7,100,0,100,0,100,0,100,0,48,117,48,117,48,117,100,0,100,0,100,0,48,117,48,117,100,0,100,0,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,44,1,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,112,23,112,23,112,23,112,23,8,7,8,7,8,7,8,7,112,23,112,23,112,23,112,23,112,23,112,23,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,112,23,112,23,112,23,112,23,255,255,255,255,220,5,220,5,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,220,5,220,5,220,5,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,44,1,0,5,10,5,0,2,0,10,0,30,0,5,0,5,0,5,0,5,0,5,0,5,0,64,1,100,0,100,0,100,0,200,0,200,0,200,0,64,1,64,1,64,1,10,0,0,0,0,0,0,173,32,0,0};
-
-        memcpy(config_buffer, bsec_config_iaq, n_buffer);
-        return sizeof(bsec_config_iaq);
+    static const BSecConfigProfile* bsec_config_load(const string& name) {
+        const BSecConfigProfile *profile = findBSecConfigProfile(name);
+        if (profile == nullptr) {
+            spdlog::error("[BSecProxy] Unknown BSEC config {} (available: {})", name, bsecConfigProfileNames());
+            return nullptr;
+        }
+        if (profile->length > BSEC_MAX_PROPERTY_BLOB_SIZE) {
+            spdlog::error("[BSecProxy] BSEC config {} is too large: {} bytes (max {})", name, profile->length, BSEC_MAX_PROPERTY_BLOB_SIZE);
+            return nullptr;
+        }
+        spdlog::info("[BSecProxy] BSec config {} ({} bytes)", profile->name, profile->length);
+        return profile;
     }
 };
 
@@ -207,105 +310,363 @@ public:
 /* AirQualityService Public Implementation */
 /**********************************************************************************************************************/
 
-AirQualityService* AirQualityService::shared {nullptr};
-std::mutex AirQualityService::sharedInstanceMutex;
-
-AirQualityService::AirQualityService() {
-    spdlog::debug("AirQualityService init");
+AirQualityService::AirQualityService(AirQualityServiceConfig config)
+    : config(config), stateStore(config.stateFile, IAQ_STATE_GENERATIONS),
+      samplingStats(IAQ_SAMPLING_STATS_WINDOW), stopping(false), events(config.name) {
+    spdlog::debug("AirQualityService init: {}", config.name);
+    context = SensorContext{this, nullptr, 0};
+    airQuality = AirQuality{};
+    clock = &monotonicClock;
+    sampleRate = BSEC_SAMPLE_RATE_LP;
+    wantedSampleRate = sampleRate;
+    savedAccuracy = 0;
+    lastSaveNs = 0;
+    failedSaveNs = 0;
+    deadlineNs = 0;
+    recorder = nullptr;
+    replayBus = nullptr;
+    replayOffsetNs = 0;
+    overruns = 0;
+    callbackTimeNs = 0;
+    sampleLatenessUs = 0;
+    sampleStart = SampleCounters{0, 0, 0};
 }
 
-AirQualityService* AirQualityService::sharedInstance() {
-    std::lock_guard<std::mutex> lock(sharedInstanceMutex);
-    if (shared == nullptr)
-    {
-        shared = new AirQualityService();
-    }
-    return shared;
+AirQualityService::~AirQualityService() {
+    events.stop();
+    // device handles must go before the bus they belong to
+    sensor.reset();
+    bus.reset();
+    busWorker.reset();
 }
 
 int AirQualityService::monitor() {
-    return_values_init ret;
+    int ret = start();
+    if (ret != 0) {
+        return ret;
+    }
 
-    spdlog::info("[AirQualityService] init");
+    while (!stopping) {
+        int64_t next_ns = sample(timestampNs());
 
-    if (i2c_bus.openI2CBus(IAQ_I2C_BUS_DEVICE, I2C_BUS_ADDRESS) < 0) {
-        spdlog::error("[AirQualityService] Failed to open the i2c bus");
+        // Wait until just before the next part of the sampling step is due (stop() wakes us up),
+        // then sleep precisely to its deadline
+        int64_t wakeup_ns = next_ns - IAQ_SAMPLING_WAKEUP_ADVANCE_US * 1000;
+        {
+            std::unique_lock<std::mutex> lock(stopMutex);
+            while (!stopping && clock->nowNs() < wakeup_ns) {
+                clock->waitUntilNs(stopCondition, lock, wakeup_ns);
+            }
+        }
+        if (!stopping) {
+            clock->sleepUntilNs(next_ns);
+        }
+    }
+
+    finish();
+    return 0;
+}
+
+int AirQualityService::start() {
+    spdlog::info("[AirQualityService] {}: init", config.name);
+
+    const BSecConfigProfile *bsec_config = BSecProxy::bsec_config_load(config.bsecConfig);
+    if (bsec_config == nullptr) {
         return -1;
     }
+    sampleRate = bsec_config->sampleRate;
+    wantedSampleRate = sampleRate;
 
-    // Get bsec version
-    bsec_version_t version;
-    bsec_get_version_m(bsecInstance, &version);
-    spdlog::info("[AirQualityService] BSEC version: {}.{}.{}.{}", version.major, version.minor, version.major_bugfix, version.minor_bugfix);
+    if (!bus && openSensorBus() < 0) {
+        return -1;
+    }
+    replayBus = dynamic_cast<I2CReplayBus*>(bus.get());
+    if (!transactionLogFile.empty()) {
+        // the transactions are timed on the sampling clock, like the samples
+        auto logged = std::make_unique<I2CTransactionRecorder>(std::move(bus), transactionLogFile, [this]() {
+            return clock->nowNs() / 1000;
+        });
+        recorder = logged.get();
+        bus = std::move(logged);
+    }
 
-    struct bme68x_dev bme_dev[NUM_OF_SENS];
-    for (uint8_t i = 0; i < NUM_OF_SENS; ++i) {   
-        /* Assigning a chunk of memory block to the bsecInstance */
-        allocateMemory(bsec_mem_block[i], i);
-        memset(&bme_dev[i],0,sizeof(bme_dev[i]));
-        bme_dev[i].intf = BME68X_I2C_INTF;
-        bme_dev[i].read = BSecProxy::bsec_i2c_register_read;
-        bme_dev[i].write = BSecProxy::bsec_i2c_register_write;
-        bme_dev[i].delay_us = BSecProxy::bsec_sleep_n;
-        bme_dev[i].intf_ptr = nullptr;
-        bme_dev[i].amb_temp = 0;
-
-        /* Call to the function which initializes the BSEC library */
-        ret = bsec_iot_init(SAMPLE_RATE, 0.0f, 
-            BSecProxy::bsec_i2c_register_write, 
-            BSecProxy::bsec_i2c_register_read, 
-            BSecProxy::bsec_sleep_n, 
-            BSecProxy::bsec_state_load, 
-            BSecProxy::bsec_config_load, 
-            bme_dev[i], i);
-        if (ret.bme68x_status != BME68X_OK)
-        {
-            /* Could not intialize BME68x */
-            spdlog::error("[AirQualityService] Could not intialize BME68x. Error: {}", ret.bme68x_status);
-            return (int)ret.bme68x_status;
-        }
-        else if (ret.bsec_status != BSEC_OK)
+    // Registers the sensor updates by itself must always go to the device
+    RegisterShadow& shadow = bus->registerShadow();
+    for (uint8_t reg = BME68X_REG_FIELD0; reg < BME68X_REG_FIELD0 + BME68X_N_MEAS * BME68X_LEN_FIELD_OFFSET; ++reg) {
+        shadow.markVolatile(reg);
+    }
+    shadow.markVolatile(BME68X_REG_CTRL_MEAS);
+    shadow.markVolatile(BME68X_REG_SOFT_RESET);
+    shadow.setEnabled(IAQ_I2C_REGISTER_SHADOW);
+
+    // The register operations are resolved once for the bus type, not on every access
+    context = SensorContext{this, bus.get(), 0};
+    struct bme68x_dev bme_dev;
+    memset(&bme_dev, 0, sizeof(bme_dev));
+    bme_dev.intf = (bus->busInterface() == SensorBusInterface::SPI) ? BME68X_SPI_INTF : BME68X_I2C_INTF;
+    BSecProxy::bind_bus(bus.get(), &bme_dev.read, &bme_dev.write);
+    bme_dev.delay_us = BSecProxy::bsec_sleep_n;
+    bme_dev.intf_ptr = &context;
+    bme_dev.amb_temp = 0;
+
+    uint8_t bsec_state[BSEC_MAX_STATE_BLOB_SIZE];
+    uint32_t bsec_state_len = BSecProxy::bsec_state_load(stateStore, bsec_state, sizeof(bsec_state));
+
+    sensor = std::make_unique<BSecSensor>([this](const bsec_output_t *outputs, uint8_t n_outputs) {
+        auto start = std::chrono::steady_clock::now();
+        BSecProxy::bsec_output_ready(this, outputs, n_outputs);
+        callbackTimeNs += elapsedNs(start);
+    });
+    BSecSensorStatus ret = sensor->init(bme_dev, sampleRate, 0.0f, bsec_config->data, bsec_config->length, bsec_state, bsec_state_len);
+    if (ret.bme68x_status != BME68X_OK)
+    {
+        /* Could not intialize BME68x */
+        spdlog::error("[AirQualityService] {}: Could not intialize BME68x. Error: {}", config.name, ret.bme68x_status);
+        return (int)ret.bme68x_status;
+    }
+    else if (ret.bsec_status != BSEC_OK)
+    {
+        /* Could not intialize BSEC library */
+        if (ret.bsec_status == BSEC_W_SU_SAMPLERATEMISMATCH)
         {
-            /* Could not intialize BSEC library */
-            if (ret.bsec_status == BSEC_W_SU_SAMPLERATEMISMATCH)
-            {
-                /* Handle here the error */
-                spdlog::error("[AirQualityService] The sample rate doesn't match the config. The SAMPLE_RATE is defined in bsec_integration.h file.");
-            }
-            spdlog::error("[AirQualityService] Could not intialize BSEC library.");
-            return (int)ret.bsec_status;
+            /* Handle here the error */
+            spdlog::error("[AirQualityService] The sample rate doesn't match the config {}.", config.bsecConfig);
         }
+        spdlog::error("[AirQualityService] {}: Could not intialize BSEC library.", config.name);
+        return (int)ret.bsec_status;
     }
 
-    spdlog::info("[AirQualityService] Starting air monitoring");
+    // the state on disk is as of now: the accuracy it was saved with is told by the first outputs
+    savedAccuracy = (bsec_state_len > 0) ? -1 : 0;
+    lastSaveNs = clock->nowNs();
 
-    /* Call to endless loop function which reads and processes data based on sensor settings */
-    /* State is saved every 10.000 samples, which means every 10.000 * 3 secs = 500 minutes  */
-    bsec_iot_loop(BSecProxy::bsec_sleep_n, BSecProxy::bsec_get_timestamp_us, BSecProxy::bsec_output_ready, BSecProxy::bsec_state_save, 10000);
+    bsec_version_t version = sensor->version();
+    spdlog::info("[AirQualityService] BSEC version: {}.{}.{}.{}", version.major, version.minor, version.major_bugfix, version.minor_bugfix);
 
-    spdlog::info("[AirQualityService] Air monitoring stopped!");
+    events.start();
 
+    spdlog::info("[AirQualityService] {}: Starting air monitoring", config.name);
     return 0;
 }
 
-void AirQualityService::setOnAirQualityChange(std::function<void(AirQuality)> onQualityChange) {
-    this->onAirQualityChange = onQualityChange;
+int64_t AirQualityService::sample(int64_t timestampNs) {
+    // BSEC expects the sensor control calls on time, report the steps that start late
+    int64_t late_ns = timestampNs - deadlineNs;
+    if (deadlineNs != 0 && late_ns > IAQ_SAMPLING_OVERRUN_MS * 1000000LL) {
+        ++overruns;
+        spdlog::warn("[AirQualityService] {}: sampling step {} ms late ({} overruns)", config.name, late_ns / 1000000, overruns.load());
+    }
+
+    // A sample starts with its sensor control and ends once its measurement is processed
+    if (!sensor->isMeasuring()) {
+        sampleLatenessUs = (deadlineNs != 0 && late_ns > 0) ? late_ns / 1000 : 0;
+        sampleStart = sampleCounters();
+    }
+
+    // A replay gives BSEC the times of the recording: the same inputs at the same times give the same outputs
+    int64_t sensorNs = timestampNs;
+    if (replayBus != nullptr) {
+        int64_t recordedNs;
+        if (replayBus->nextSample(&recordedNs)) {
+            replayOffsetNs = recordedNs - timestampNs;
+        }
+        sensorNs += replayOffsetNs;
+    }
+    if (recorder != nullptr) {
+        recorder->markSample(sensorNs);
+    }
+    deadlineNs = nextDeadline(sensorNs) - replayOffsetNs;
+
+    if (checkpointDue(timestampNs)) {
+        saveState();
+    }
+    if (!sensor->isMeasuring()) {
+        SampleCounters end = sampleCounters();
+        samplingStats.record(SampleTiming{sampleLatenessUs, (end.busNs - sampleStart.busNs) / 1000,
+            (end.bsecNs - sampleStart.bsecNs) / 1000, (end.callbackNs - sampleStart.callbackNs) / 1000});
+    }
+    return deadlineNs;
+}
+
+AirQualityService::SampleCounters AirQualityService::sampleCounters() {
+    return SampleCounters{context.busTimeNs, sensor->bsecTime(), callbackTimeNs};
 }
 
-void AirQualityService::outputReady(AirQuality output) {
-    onAirQualityChange(output);
+int64_t AirQualityService::nextDeadline(int64_t timestampNs) {
+    // A measurement is triggered by one call and collected by the next one, once complete
+    BSecSensorStatus ret = sensor->isMeasuring() ? sensor->collect() : sensor->trigger(timestampNs);
+    if (ret.bme68x_status != BME68X_OK) {
+        spdlog::error("[AirQualityService] {}: sensor error: {}", config.name, ret.bme68x_status);
+    } else if (ret.bsec_status != BSEC_OK) {
+        spdlog::debug("[AirQualityService] {}: bsec_status: {}", config.name, ret.bsec_status);
+    }
+
+    // the subscription only changes between two measurements
+    if (!sensor->isMeasuring() && wantedSampleRate != sampleRate) {
+        switchSampleRate();
+    }
+
+    if (sensor->isMeasuring()) {
+        return sensor->measurementReadyNs();
+    }
+    if (sensor->nextCallNs() > timestampNs) {
+        return sensor->nextCallNs();
+    }
+    // BSEC didn't plan the next call (failed sensor control): retry one sample period later
+    return timestampNs + (int64_t)(1000000000.0 / sampleRate);
 }
-    
-int8_t AirQualityService::readI2CRegister(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
-    if (!i2c_bus.isOpened()) {
-        return -1;
+
+void AirQualityService::switchSampleRate() {
+    const char *mode = (wantedSampleRate == BSEC_SAMPLE_RATE_ULP) ? "ULP" : "LP";
+    bsec_library_return_t status = sensor->updateSubscription(wantedSampleRate);
+    if (status < BSEC_OK) {
+        // keep the current rate for good rather than retrying after every sample
+        spdlog::error("[AirQualityService] {}: could not switch to the {} sample rate ({}), sample rate switching disabled", config.name, mode, status);
+        ratePolicy.reset();
+        wantedSampleRate = sampleRate;
+        return;
     }
-    return i2c_bus.readData(reg_addr, reg_data_ptr, data_len);
+    if (status == BSEC_W_SU_SAMPLERATEMISMATCH) {
+        spdlog::warn("[AirQualityService] {}: the {} sample rate doesn't match the config {}", config.name, mode, config.bsecConfig);
+    }
+    spdlog::info("[AirQualityService] {}: sampling at the {} rate", config.name, mode);
+    sampleRate = wantedSampleRate;
+}
+
+void AirQualityService::finish() {
+    saveState();
+    logSamplingStatistics(spdlog::level::info);
+    events.stop();
+    spdlog::info("[AirQualityService] {}: Air monitoring stopped!", config.name);
+}
+
+bool AirQualityService::isStopping() {
+    return stopping;
+}
+
+int64_t AirQualityService::timestampNs() {
+    return clock->nowNs();
+}
+
+void AirQualityService::setClock(SamplingClock *clock) {
+    this->clock = clock;
 }
 
-int8_t AirQualityService::writeI2CRegister(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
-    if (!i2c_bus.isOpened()) {
+uint64_t AirQualityService::samplingOverruns() {
+    return overruns;
+}
+
+SamplingStatsSnapshot AirQualityService::samplingStatistics() {
+    return samplingStats.snapshot();
+}
+
+void AirQualityService::logSamplingStatistics(spdlog::level::level_enum level) {
+    if (!spdlog::should_log(level)) {
+        return;
+    }
+    SamplingStatsSnapshot stats = samplingStats.snapshot();
+    spdlog::log(level, "[AirQualityService] {}: {} samples, lateness p50={}us p99={}us max={}us, bus p50={}us p99={}us, bsec p50={}us p99={}us max={}us, callback p50={}us p99={}us max={}us (overruns: {})",
+        config.name, stats.samples,
+        stats.lateness.percentileUs(50), stats.lateness.percentileUs(99), stats.lateness.maxUs,
+        stats.bus.percentileUs(50), stats.bus.percentileUs(99),
+        stats.bsec.percentileUs(50), stats.bsec.percentileUs(99), stats.bsec.maxUs,
+        stats.callback.percentileUs(50), stats.callback.percentileUs(99), stats.callback.maxUs, overruns.load());
+}
+
+void AirQualityService::stop() {
+    {
+        std::lock_guard<std::mutex> lock(stopMutex);
+        stopping = true;
+    }
+    stopCondition.notify_all();
+}
+
+void AirQualityService::subscribe(AirQualitySubscription subscription) {
+    events.subscribe(subscription);
+}
+
+void AirQualityService::setSensorBus(std::unique_ptr<SensorBus> bus) {
+    this->bus = std::move(bus);
+}
+
+void AirQualityService::setSampleRatePolicy(std::unique_ptr<SampleRatePolicy> policy) {
+    this->ratePolicy = std::move(policy);
+}
+
+void AirQualityService::setTransactionLogFile(const std::string& path) {
+    this->transactionLogFile = path;
+}
+
+BusStatsSnapshot AirQualityService::busStatistics() {
+    return bus->statistics().snapshot();
+}
+
+const AirQualityServiceConfig& AirQualityService::configuration() {
+    return config;
+}
+
+/**********************************************************************************************************************/
+/* AirQualityService Private Implementation */
+/**********************************************************************************************************************/
+
+int AirQualityService::openSensorBus() {
+    if (config.interface == SensorBusInterface::SPI) {
+        auto spiBus = std::make_unique<SimpleSPIBus>();
+        if (spiBus->openSPIBus(IAQ_SPI_BUS_DEVICE, IAQ_SPI_SPEED_HZ) < 0) {
+            spdlog::error("[AirQualityService] Failed to open the spi bus");
+            return -1;
+        }
+        bus = std::move(spiBus);
+        return 0;
+    }
+
+    i2cBus = std::make_unique<SimpleI2CBus>();
+    if (i2cBus->openI2CBus(IAQ_I2C_BUS_DEVICE) < 0) {
+        spdlog::error("[AirQualityService] Failed to open the i2c bus");
         return -1;
     }
-    return i2c_bus.writeData(reg_addr, reg_data_ptr, data_len);
-}
\ No newline at end of file
+    i2cBus->setMultiplexerAddress(IAQ_I2C_MUX_ADDRESS);
+    if (IAQ_I2C_BUS_WORKER) {
+        busWorker = std::make_unique<I2CBusWorker>(i2cBus.get());
+        busWorker->start();
+        bus = busWorker->attachDevice(config.address, config.muxChannel);
+    } else {
+        bus = i2cBus->attachDevice(config.address, config.muxChannel);
+    }
+    if (!bus) {
+        return -1;
+    }
+    return 0;
+}
+
+void AirQualityService::saveState() {
+    if (!sensor) {
+        return;
+    }
+    uint8_t bsec_state[BSEC_MAX_STATE_BLOB_SIZE];
+    uint32_t bsec_state_len = 0;
+    bsec_library_return_t status = sensor->getState(bsec_state, sizeof(bsec_state), &bsec_state_len);
+    if (status != BSEC_OK) {
+        spdlog::error("[AirQualityService] {}: Could not get the BSEC state: {}", config.name, status);
+        failedSaveNs = timestampNs();
+        return;
+    }
+    if (BSecProxy::bsec_state_save(stateStore, bsec_state, bsec_state_len) < 0) {
+        // still due: retried once IAQ_STATE_SAVE_MIN_INTERVAL is over
+        failedSaveNs = timestampNs();
+        return;
+    }
+    savedAccuracy = airQuality.iaq_accuracy;
+    lastSaveNs = timestampNs();
+}
+
+bool AirQualityService::checkpointDue(int64_t timestampNs) {
+    // State is saved as soon as the IAQ accuracy improves on the saved one, and every
+    // IAQ_STATE_SAVE_MAX_INTERVAL otherwise, never more often than IAQ_STATE_SAVE_MIN_INTERVAL.
+    // Both are times: the number of samples in an interval depends on the sample rate.
+    int64_t lastAttemptNs = std::max(lastSaveNs, failedSaveNs);
+    if (timestampNs - lastAttemptNs < IAQ_STATE_SAVE_MIN_INTERVAL * 1000000000LL) {
+        return false;
+    }
+    return airQuality.iaq_accuracy > savedAccuracy || timestampNs - lastSaveNs >= IAQ_STATE_SAVE_MAX_INTERVAL * 1000000000LL;
+}
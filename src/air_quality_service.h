@@ -22,44 +22,162 @@
 #include <unistd.h>
 #include <cstdint>
 #include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
-#include "simple_i2c_bus.h"
-
-struct AirQuality {
-    float iaq;
-    int iaq_accuracy;
-    float temperature;
-    float pressure;
-    float humidity;
-    float co2;
-    float bVOC;
-    float gas_percentage;
+#include <string>
+#include <spdlog/common.h>
+#include "air_quality.h"
+#include "air_quality_event_bus.h"
+#include "sampling_statistics.h"
+#include "sensor_bus.h"
+#include "state_store.h"
+
+struct AirQualityServiceConfig {
+    std::string name;                   // sensor name, used in the logs
+    std::string stateFile;              // file keeping the BSEC state between runs
+    SensorBusInterface interface;       // interface of the sensor when no bus is injected
+    uint8_t address;                    // I2C address of the sensor
+    int muxChannel;                     // TCA9548A channel of the sensor (-1 when directly on the bus)
+    std::string bsecConfig;             // embedded BSEC configuration (bsec/config), "33v_3s_4d" for instance
 };
 
 class BSecProxy;
+class SamplingClock;
+class SampleRatePolicy;
+class I2CTransactionRecorder;
+class I2CReplayBus;
+class BSecSensor;
+class SimpleI2CBus;
+class I2CBusWorker;
+
+/*
+    Monitoring of one BME68x sensor with its own BSEC instance.
+    Services are independent: several of them, one per sensor, can monitor concurrently
+    in the same process, either with monitor (one thread each) or driven step by step with
+    start / sample / finish (SamplingScheduler).
+*/
 
 class AirQualityService {
 public:
-    static AirQualityService* sharedInstance();
+    AirQualityService(AirQualityServiceConfig config);
+    ~AirQualityService();
     AirQualityService(const AirQualityService& obj) = delete; 
     void operator=(const AirQualityService &) = delete;
 
+    /// @brief Initialize the sensor and monitor it on the calling thread until stop is called
+    /// @return 0 once stopped, an error code if the sensor or BSEC could not be initialized
     int monitor();
-    void setOnAirQualityChange(std::function<void(AirQuality)> onQualityChange);
+
+    /// @brief Make monitor return (can be called from any thread)
+    void stop();
+
+    /// @brief Open the bus, initialize the sensor and its BSEC instance (first step of monitor)
+    /// @return 0 or an error code
+    int start();
+
+    /// @brief Run the part of the sampling step that is due: trigger a measurement or collect it
+    /// @param timestampNs the current time (nanoseconds)
+    /// @return the time sample must be called again (nanoseconds)
+    int64_t sample(int64_t timestampNs);
+
+    /// @brief Save the BSEC state once the monitoring is over (last step of monitor)
+    void finish();
+
+    /// @brief Check if stop was called
+    bool isStopping();
+
+    /// @brief Current time of the sampling clock (nanoseconds)
+    int64_t timestampNs();
+
+    /// @brief Use the given time source for the sampling instead of CLOCK_MONOTONIC (must be called before monitor)
+    /// @param clock the clock, a VirtualClock to simulate faster than real time for instance
+    void setClock(SamplingClock *clock);
+
+    /// @brief Number of sampling steps that started more than IAQ_SAMPLING_OVERRUN_MS after their deadline
+    uint64_t samplingOverruns();
+
+    /// @brief Rolling percentiles of the sample timings: lateness, bus, BSEC and output callback time (can be called from any thread)
+    SamplingStatsSnapshot samplingStatistics();
+
+    /// @brief Add a consumer of the air quality samples, called on a thread of its own (must be called before monitor)
+    /// @param subscription the callback of the consumer and the samples it wants
+    void subscribe(AirQualitySubscription subscription);
+
+    /// @brief Use the given bus to talk to the sensor instead of opening the one of the configuration (must be called before monitor)
+    /// @param bus the bus to use (a simulated sensor or a device of a shared I2C bus for instance), BSEC is given
+    /// the recorded sample times of an I2CReplayBus
+    void setSensorBus(std::unique_ptr<SensorBus> bus);
+
+    /// @brief Switch the BSEC sample rate between LP and ULP as the policy decides after every sample (must be called before monitor)
+    /// @param policy the policy, the rate of the BSEC configuration is kept without one
+    void setSampleRatePolicy(std::unique_ptr<SampleRatePolicy> policy);
+
+    /// @brief Log every sensor bus transaction, and the time of every sampling step, to a file that can be replayed
+    /// with I2CReplayBus (must be called before monitor)
+    /// @param path the transaction log file
+    void setTransactionLogFile(const std::string& path);
+
+    /// @brief Snapshot of the sensor bus latency, byte and error counters (can be called from any thread once monitor is running)
+    BusStatsSnapshot busStatistics();
+
+    const AirQualityServiceConfig& configuration();
 
     friend class BSecProxy;
 
 private:
-    AirQualityService();
+    /// @brief What the driver callbacks of the sensor need, handed to them through bme68x_dev.intf_ptr
+    struct SensorContext {
+        AirQualityService *service;
+        SensorBus *bus;
+        uint64_t busTimeNs;                   // time spent in the register callbacks
+    };
+
+    /// @brief Time counters (nanoseconds) a sample timing is the difference of
+    struct SampleCounters {
+        uint64_t busNs;
+        uint64_t bsecNs;
+        uint64_t callbackNs;
+    };
 
-    static AirQualityService* shared;
-    static std::mutex sharedInstanceMutex;
+    AirQualityServiceConfig config;
+    StateStore stateStore;                    // generations of the BSEC state of config.stateFile
+    std::unique_ptr<SimpleI2CBus> i2cBus;     // opened by monitor() when no bus was injected
+    std::unique_ptr<I2CBusWorker> busWorker;  // thread doing the i2cBus transfers (IAQ_I2C_BUS_WORKER)
+    std::unique_ptr<SensorBus> bus;
+    std::string transactionLogFile;
+    I2CTransactionRecorder *recorder;         // wraps the bus when transactionLogFile is set
+    I2CReplayBus *replayBus;                  // the bus when it replays a transaction log
+    int64_t replayOffsetNs;                   // time of the recorded sample minus the sampling clock time
+    SensorContext context;                    // the driver keeps a pointer to it
+    std::unique_ptr<BSecSensor> sensor;
+    AirQuality airQuality;                    // last outputs of BSEC
+    SamplingClock *clock;
+    float sampleRate;                         // BSEC sample rate subscribed (the one of the configuration at start)
+    float wantedSampleRate;                   // sample rate chosen by the ratePolicy after the last sample
+    std::unique_ptr<SampleRatePolicy> ratePolicy;
+    int savedAccuracy;                        // IAQ accuracy when the state was last saved (-1: restored, not known yet)
+    int64_t lastSaveNs;                       // time the state was last saved (the start when it was restored)
+    int64_t failedSaveNs;                     // time a save last failed (0: never)
+    int64_t deadlineNs;                       // time the current sample call was due (0 before the first one)
+    std::atomic<uint64_t> overruns;
+    uint64_t callbackTimeNs;                  // time spent in the BSEC outputs callback
+    uint64_t sampleLatenessUs;                // lateness of the current sample
+    SampleCounters sampleStart;               // counters at the start of the current sample
+    SamplingStatistics samplingStats;
+    std::atomic<bool> stopping;
+    std::mutex stopMutex;
+    std::condition_variable stopCondition;
+    AirQualityEventBus events;                // subscribers of the samples
 
-    SimpleI2CBus i2c_bus;
-    std::function<void(AirQuality)> onAirQualityChange;
-    void outputReady(AirQuality output);
-    int8_t readI2CRegister(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len);
-    int8_t writeI2CRegister(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len);
+    int openSensorBus();
+    int64_t nextDeadline(int64_t timestampNs);
+    void switchSampleRate();
+    SampleCounters sampleCounters();
+    void logSamplingStatistics(spdlog::level::level_enum level);
+    void saveState();
+    bool checkpointDue(int64_t timestampNs);
 };
 
-#endif // AIR_QUALITY_SERVICE_H_
\ No newline at end of file
+#endif // AIR_QUALITY_SERVICE_H_
@@ -0,0 +1,39 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bsec_config_profile.h"
+
+const BSecConfigProfile* findBSecConfigProfile(const std::string& name) {
+    for (size_t i = 0; i < bsecConfigProfileCount; ++i) {
+        if (name == bsecConfigProfiles[i].name) {
+            return &bsecConfigProfiles[i];
+        }
+    }
+    return nullptr;
+}
+
+std::string bsecConfigProfileNames() {
+    std::string names;
+    for (size_t i = 0; i < bsecConfigProfileCount; ++i) {
+        if (!names.empty()) {
+            names += ", ";
+        }
+        names += bsecConfigProfiles[i].name;
+    }
+    return names;
+}
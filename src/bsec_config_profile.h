@@ -0,0 +1,45 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BSEC_CONFIG_PROFILE_H_
+#define BSEC_CONFIG_PROFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "bsec_datatypes.h"
+
+/// @brief A BSEC configuration embedded at build time (cmake/BSecConfigs.cmake, bsec/config)
+struct BSecConfigProfile {
+    const char *name;           // supply voltage, sample period and history: "33v_3s_4d" for instance
+    float sampleRate;           // BSEC sample rate the configuration was made for
+    const uint8_t *data;        // serialized configuration (read-only)
+    uint32_t length;
+};
+
+extern const BSecConfigProfile bsecConfigProfiles[];
+extern const size_t bsecConfigProfileCount;
+
+/// @brief Find an embedded configuration
+/// @return the profile or nullptr if there is none with this name
+const BSecConfigProfile* findBSecConfigProfile(const std::string& name);
+
+/// @brief Names of the embedded configurations, comma separated (for the logs and the usage)
+std::string bsecConfigProfileNames();
+
+#endif // BSEC_CONFIG_PROFILE_H_
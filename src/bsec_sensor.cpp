@@ -0,0 +1,319 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bsec_sensor.h"
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include <cstring>
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Virtual sensors subscribed to, the outputs the IAQ configuration provides
+static const uint8_t subscribedOutputs[] = {
+    BSEC_OUTPUT_IAQ,
+    BSEC_OUTPUT_STATIC_IAQ,
+    BSEC_OUTPUT_CO2_EQUIVALENT,
+    BSEC_OUTPUT_BREATH_VOC_EQUIVALENT,
+    BSEC_OUTPUT_RAW_PRESSURE,
+    BSEC_OUTPUT_RAW_TEMPERATURE,
+    BSEC_OUTPUT_RAW_HUMIDITY,
+    BSEC_OUTPUT_RAW_GAS,
+    BSEC_OUTPUT_STABILIZATION_STATUS,
+    BSEC_OUTPUT_RUN_IN_STATUS,
+    BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE,
+    BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY,
+    BSEC_OUTPUT_GAS_PERCENTAGE
+};
+
+BSecSensor::BSecSensor(std::function<void(const bsec_output_t*, uint8_t)> onOutputs)
+    : instance(bsec_get_instance_size_m()), onOutputs(onOutputs) {
+    memset(&dev, 0, sizeof(dev));
+    memset(&conf, 0, sizeof(conf));
+    memset(&heaterConf, 0, sizeof(heaterConf));
+    memset(&settings, 0, sizeof(settings));
+    opMode = BME68X_SLEEP_MODE;
+    heaterStale = false;
+    measuring = false;
+    triggerNs = 0;
+    dataReadyNs = 0;
+    bsecTimeNs = 0;
+    temperatureOffset = 0;
+}
+
+BSecSensorStatus BSecSensor::init(const struct bme68x_dev& dev, float sampleRate, float temperatureOffset,
+    const uint8_t *config, uint32_t configLength, const uint8_t *state, uint32_t stateLength) {
+    BSecSensorStatus status {BME68X_OK, BSEC_OK};
+    this->dev = dev;
+    this->temperatureOffset = temperatureOffset;
+
+    status.bme68x_status = bme68x_init(&this->dev);
+    if (status.bme68x_status != BME68X_OK) {
+        return status;
+    }
+
+    status.bsec_status = bsec_init_m(instance.data());
+    if (status.bsec_status != BSEC_OK) {
+        return status;
+    }
+
+    uint8_t workBuffer[BSEC_MAX_WORKBUFFER_SIZE];
+    if (config != nullptr && configLength > 0) {
+        status.bsec_status = bsec_set_configuration_m(instance.data(), config, configLength, workBuffer, sizeof(workBuffer));
+        if (status.bsec_status != BSEC_OK) {
+            return status;
+        }
+    }
+    if (state != nullptr && stateLength > 0) {
+        status.bsec_status = bsec_set_state_m(instance.data(), state, stateLength, workBuffer, sizeof(workBuffer));
+        if (status.bsec_status != BSEC_OK) {
+            return status;
+        }
+    }
+
+    status.bsec_status = updateSubscription(sampleRate);
+    return status;
+}
+
+bsec_library_return_t BSecSensor::updateSubscription(float sampleRate) {
+    const uint8_t n_requested = sizeof(subscribedOutputs) / sizeof(subscribedOutputs[0]);
+    bsec_sensor_configuration_t requested[n_requested];
+    for (uint8_t i = 0; i < n_requested; ++i) {
+        requested[i].sensor_id = subscribedOutputs[i];
+        requested[i].sample_rate = sampleRate;
+    }
+    bsec_sensor_configuration_t required[BSEC_MAX_PHYSICAL_SENSOR];
+    uint8_t n_required = BSEC_MAX_PHYSICAL_SENSOR;
+    bsec_library_return_t status = bsec_update_subscription_m(instance.data(), requested, n_requested, required, &n_required);
+    if (status >= BSEC_OK) {
+        heaterStale = true;
+    }
+    return status;
+}
+
+int64_t BSecSensor::nextCallNs() {
+    return settings.next_call;
+}
+
+BSecSensorStatus BSecSensor::trigger(int64_t timestampNs) {
+    BSecSensorStatus status {BME68X_OK, BSEC_OK};
+    measuring = false;
+
+    // BSEC tells what to measure and when to come back
+    auto start = std::chrono::steady_clock::now();
+    status.bsec_status = bsec_sensor_control_m(instance.data(), timestampNs, &settings);
+    bsecTimeNs += elapsedNs(start);
+    if (status.bsec_status < BSEC_OK) {
+        return status;
+    }
+
+    uint32_t duration_us = 0;
+    switch (settings.op_mode) {
+        case BME68X_FORCED_MODE:
+            status.bme68x_status = configureForced();
+            // the data is ready after the TPH conversions and the heater duration
+            duration_us = bme68x_get_meas_dur(BME68X_FORCED_MODE, &conf, &dev) + (uint32_t)settings.heater_duration * 1000;
+            break;
+        case BME68X_PARALLEL_MODE:
+            // the sensor keeps running the heater profile: configure it once per sample rate
+            if (opMode != settings.op_mode || heaterStale) {
+                status.bme68x_status = configureParallel();
+                heaterStale = false;
+            }
+            break;
+        case BME68X_SLEEP_MODE:
+            if (opMode != settings.op_mode) {
+                status.bme68x_status = bme68x_set_op_mode(BME68X_SLEEP_MODE, &dev);
+                opMode = BME68X_SLEEP_MODE;
+            }
+            break;
+    }
+    if (status.bme68x_status != BME68X_OK) {
+        return status;
+    }
+
+    if (settings.trigger_measurement && settings.op_mode != BME68X_SLEEP_MODE) {
+        measuring = true;
+        triggerNs = timestampNs;
+        dataReadyNs = timestampNs + (int64_t)duration_us * 1000;
+    }
+    return status;
+}
+
+bool BSecSensor::isMeasuring() {
+    return measuring;
+}
+
+int64_t BSecSensor::measurementReadyNs() {
+    return dataReadyNs;
+}
+
+BSecSensorStatus BSecSensor::collect() {
+    BSecSensorStatus status {BME68X_OK, BSEC_OK};
+    if (!measuring) {
+        return status;
+    }
+    measuring = false;
+
+    struct bme68x_data data[BME68X_N_MEAS];
+    uint8_t n_fields = 0;
+    status.bme68x_status = bme68x_get_data(opMode, data, &n_fields, &dev);
+    if (status.bme68x_status < BME68X_OK) {
+        return status;
+    }
+    // no new data is only a warning
+    status.bme68x_status = BME68X_OK;
+    for (uint8_t i = 0; i < n_fields; ++i) {
+        if (data[i].status & BME68X_GASM_VALID_MSK) {
+            status.bsec_status = process(triggerNs, data[i]);
+        }
+    }
+    return status;
+}
+
+BSecSensorStatus BSecSensor::step(int64_t timestampNs) {
+    BSecSensorStatus status = trigger(timestampNs);
+    if (status.bme68x_status != BME68X_OK || status.bsec_status < BSEC_OK || !measuring) {
+        return status;
+    }
+    if (dataReadyNs > timestampNs) {
+        dev.delay_us((uint32_t)((dataReadyNs - timestampNs) / 1000), dev.intf_ptr);
+    }
+    BSecSensorStatus collected = collect();
+    if (collected.bsec_status == BSEC_OK) {
+        collected.bsec_status = status.bsec_status;
+    }
+    return collected;
+}
+
+bsec_library_return_t BSecSensor::getState(uint8_t *state, uint32_t maxLength, uint32_t *length) {
+    uint8_t workBuffer[BSEC_MAX_WORKBUFFER_SIZE];
+    return bsec_get_state_m(instance.data(), 0, state, maxLength, workBuffer, sizeof(workBuffer), length);
+}
+
+uint64_t BSecSensor::bsecTime() {
+    return bsecTimeNs;
+}
+
+bsec_version_t BSecSensor::version() {
+    bsec_version_t version;
+    memset(&version, 0, sizeof(version));
+    bsec_get_version_m(instance.data(), &version);
+    return version;
+}
+
+/**********************************************************************************************************************/
+/* BSecSensor Private Implementation */
+/**********************************************************************************************************************/
+
+int8_t BSecSensor::configureForced() {
+    int8_t rslt = bme68x_get_conf(&conf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+    conf.os_hum = settings.humidity_oversampling;
+    conf.os_temp = settings.temperature_oversampling;
+    conf.os_pres = settings.pressure_oversampling;
+    rslt = bme68x_set_conf(&conf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+
+    heaterConf.enable = BME68X_ENABLE;
+    heaterConf.heatr_temp = settings.heater_temperature;
+    heaterConf.heatr_dur = settings.heater_duration;
+    rslt = bme68x_set_heatr_conf(BME68X_FORCED_MODE, &heaterConf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+
+    rslt = bme68x_set_op_mode(BME68X_FORCED_MODE, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+    opMode = BME68X_FORCED_MODE;
+    return rslt;
+}
+
+int8_t BSecSensor::configureParallel() {
+    int8_t rslt = bme68x_get_conf(&conf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+    conf.os_hum = settings.humidity_oversampling;
+    conf.os_temp = settings.temperature_oversampling;
+    conf.os_pres = settings.pressure_oversampling;
+    rslt = bme68x_set_conf(&conf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+
+    heaterConf.enable = BME68X_ENABLE;
+    heaterConf.heatr_temp_prof = settings.heater_temperature_profile;
+    heaterConf.heatr_dur_prof = settings.heater_duration_profile;
+    heaterConf.profile_len = settings.heater_profile_len;
+    // each profile step lasts BSEC_SENSOR_TOTAL_HEAT_DUR, TPH conversions included
+    heaterConf.shared_heatr_dur = BSEC_SENSOR_TOTAL_HEAT_DUR - (bme68x_get_meas_dur(BME68X_PARALLEL_MODE, &conf, &dev) / 1000);
+    rslt = bme68x_set_heatr_conf(BME68X_PARALLEL_MODE, &heaterConf, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+
+    rslt = bme68x_set_op_mode(BME68X_PARALLEL_MODE, &dev);
+    if (rslt != BME68X_OK) {
+        return rslt;
+    }
+    opMode = BME68X_PARALLEL_MODE;
+    return rslt;
+}
+
+bsec_library_return_t BSecSensor::process(int64_t timestampNs, const struct bme68x_data& data) {
+    bsec_input_t inputs[BSEC_MAX_PHYSICAL_SENSOR];
+    uint8_t n_inputs = 0;
+    // only the inputs BSEC asked for in process_data are given to it (requested: the input asked for)
+    auto addInput = [&](uint8_t sensor_id, float signal, uint8_t requested) {
+        if (n_inputs < BSEC_MAX_PHYSICAL_SENSOR && (settings.process_data & (1 << (requested - 1)))) {
+            memset(&inputs[n_inputs], 0, sizeof(bsec_input_t));
+            inputs[n_inputs].time_stamp = timestampNs;
+            inputs[n_inputs].signal = signal;
+            inputs[n_inputs].sensor_id = sensor_id;
+            ++n_inputs;
+        }
+    };
+    // BSEC never asks for the heat source itself: like in the BSEC examples, it goes with the temperature
+    addInput(BSEC_INPUT_HEATSOURCE, temperatureOffset, BSEC_INPUT_TEMPERATURE);
+    addInput(BSEC_INPUT_TEMPERATURE, data.temperature, BSEC_INPUT_TEMPERATURE);
+    addInput(BSEC_INPUT_HUMIDITY, data.humidity, BSEC_INPUT_HUMIDITY);
+    addInput(BSEC_INPUT_PRESSURE, data.pressure, BSEC_INPUT_PRESSURE);
+    addInput(BSEC_INPUT_GASRESISTOR, data.gas_resistance, BSEC_INPUT_GASRESISTOR);
+    addInput(BSEC_INPUT_PROFILE_PART, (opMode == BME68X_FORCED_MODE) ? 0 : data.gas_index, BSEC_INPUT_PROFILE_PART);
+    if (n_inputs == 0) {
+        return BSEC_OK;
+    }
+
+    bsec_output_t outputs[BSEC_NUMBER_OUTPUTS];
+    uint8_t n_outputs = BSEC_NUMBER_OUTPUTS;
+    auto start = std::chrono::steady_clock::now();
+    bsec_library_return_t ret = bsec_do_steps_m(instance.data(), inputs, n_inputs, outputs, &n_outputs);
+    bsecTimeNs += elapsedNs(start);
+    if (ret == BSEC_OK && n_outputs > 0 && onOutputs) {
+        onOutputs(outputs, n_outputs);
+    }
+    return ret;
+}
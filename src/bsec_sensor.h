@@ -0,0 +1,118 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BSEC_SENSOR_H_
+#define BSEC_SENSOR_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "bme68x.h"
+#include "bsec_interface_multi.h"
+
+#define BSEC_SENSOR_TOTAL_HEAT_DUR 140          // duration of a parallel mode heater profile step (ms)
+
+/// @brief Status of a sensor operation (driver and BSEC results, like return_values_init of the BSEC examples)
+struct BSecSensorStatus {
+    int8_t bme68x_status;
+    bsec_library_return_t bsec_status;
+};
+
+/*
+    Sampling engine of one BME68x and its own BSEC instance.
+    It replaces bsec_iot_init / bsec_iot_loop of the BSEC examples, which keep every sensor in
+    globals and never return: the owner calls step() once nextCallNs() is due, from its own
+    thread and loop, so several sensors can run side by side in one process.
+*/
+
+class BSecSensor {
+private:
+    std::vector<uint8_t> instance;          // BSEC instance memory
+    struct bme68x_dev dev;
+    struct bme68x_conf conf;
+    struct bme68x_heatr_conf heaterConf;
+    bsec_bme_settings_t settings;
+    uint8_t opMode;                         // mode the sensor was last configured in
+    bool heaterStale;                       // the sample rate changed: the heater profile must be configured again
+    bool measuring;                         // a measurement was triggered and is not collected yet
+    int64_t triggerNs;                      // time of the sensor control of the pending measurement
+    int64_t dataReadyNs;                    // time the pending measurement is complete
+    uint64_t bsecTimeNs;                    // time spent in bsec_sensor_control and bsec_do_steps
+    float temperatureOffset;
+    std::function<void(const bsec_output_t*, uint8_t)> onOutputs;
+
+    int8_t configureForced();
+    int8_t configureParallel();
+    bsec_library_return_t process(int64_t timestampNs, const struct bme68x_data& data);
+
+public:
+    /// @brief Create a sensor
+    /// @param onOutputs called with the BSEC outputs of every processed measurement
+    BSecSensor(std::function<void(const bsec_output_t*, uint8_t)> onOutputs);
+    BSecSensor(const BSecSensor&) = delete;
+    void operator=(const BSecSensor&) = delete;
+
+    /// @brief Initialize the sensor and its BSEC instance
+    /// @param dev the driver interface of the sensor (copied, intf_ptr must outlive the sensor)
+    /// @param sampleRate the BSEC sample rate (BSEC_SAMPLE_RATE_LP for instance)
+    /// @param temperatureOffset the heat source temperature offset
+    /// @param config the serialized BSEC configuration (or nullptr for the default one)
+    /// @param configLength its length
+    /// @param state a BSEC state saved by getState (or nullptr to start from scratch)
+    /// @param stateLength its length
+    BSecSensorStatus init(const struct bme68x_dev& dev, float sampleRate, float temperatureOffset,
+        const uint8_t *config, uint32_t configLength, const uint8_t *state, uint32_t stateLength);
+
+    /// @brief Subscribe the outputs at another sample rate (between two sampling steps)
+    /// The heater profile of the new rate is configured by the next trigger.
+    bsec_library_return_t updateSubscription(float sampleRate);
+
+    /// @brief Time at which trigger must be called next (nanoseconds)
+    int64_t nextCallNs();
+
+    /// @brief First half of a sampling step: sensor control and start of the measurement
+    /// The sensor doesn't wait for the measurement, collect must be called once it is complete.
+    /// @param timestampNs the current time (nanoseconds)
+    BSecSensorStatus trigger(int64_t timestampNs);
+
+    /// @brief Check if a triggered measurement must still be collected
+    bool isMeasuring();
+
+    /// @brief Time at which the triggered measurement is complete (nanoseconds)
+    int64_t measurementReadyNs();
+
+    /// @brief Second half of a sampling step: read the measurement and give it to BSEC
+    BSecSensorStatus collect();
+
+    /// @brief Run a whole sampling step, sleeping (delay_us) during the measurement
+    /// @param timestampNs the current time (nanoseconds)
+    BSecSensorStatus step(int64_t timestampNs);
+
+    /// @brief Serialize the BSEC state
+    /// @param state the buffer to store the state
+    /// @param maxLength its size (BSEC_MAX_STATE_BLOB_SIZE)
+    /// @param length the length of the state
+    bsec_library_return_t getState(uint8_t *state, uint32_t maxLength, uint32_t *length);
+
+    /// @brief Total (real) time spent computing in BSEC since the sensor was created (nanoseconds)
+    uint64_t bsecTime();
+
+    bsec_version_t version();
+};
+
+#endif // BSEC_SENSOR_H_
@@ -0,0 +1,201 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bus_statistics.h"
+#include <cerrno>
+
+#define SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+/**********************************************************************************************************************/
+/* LatencyHistogram */
+/**********************************************************************************************************************/
+
+uint64_t LatencyHistogramSnapshot::percentileUs(double percentile) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t bound = LatencyHistogram::bucketUpperBoundUs(i);
+            return (bound < maxUs) ? bound : maxUs;
+        }
+    }
+    return maxUs;
+}
+
+void LatencyHistogramSnapshot::merge(const LatencyHistogramSnapshot& other) {
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+    totalUs += other.totalUs;
+    if (other.maxUs > maxUs) {
+        maxUs = other.maxUs;
+    }
+}
+
+LatencyHistogram::LatencyHistogram(): count(0), totalUs(0), maxUs(0) {
+    for (auto& bucket : counts) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t us) {
+    if (us < SUB_BUCKETS) {
+        return us;
+    }
+    size_t magnitude = 63 - __builtin_clzll(us);
+    size_t sub_bucket = (us >> (magnitude - LATENCY_HISTOGRAM_SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    size_t index = (magnitude - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+    return (index < LATENCY_HISTOGRAM_BUCKETS) ? index : LATENCY_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::bucketUpperBoundUs(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    size_t magnitude = index / SUB_BUCKETS - 1 + LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    uint64_t width = 1ULL << (magnitude - LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+    return (1ULL << magnitude) + (index % SUB_BUCKETS + 1) * width - 1;
+}
+
+void LatencyHistogram::record(uint64_t us) {
+    counts[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    totalUs.fetch_add(us, std::memory_order_relaxed);
+    uint64_t previous = maxUs.load(std::memory_order_relaxed);
+    while (us > previous && !maxUs.compare_exchange_weak(previous, us, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : counts) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    totalUs.store(0, std::memory_order_relaxed);
+    maxUs.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogramSnapshot LatencyHistogram::snapshot() const {
+    LatencyHistogramSnapshot snapshot;
+    for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        snapshot.counts[i] = counts[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count = count.load(std::memory_order_relaxed);
+    snapshot.totalUs = totalUs.load(std::memory_order_relaxed);
+    snapshot.maxUs = maxUs.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+/**********************************************************************************************************************/
+/* BusStatistics */
+/**********************************************************************************************************************/
+
+BusStatistics::OperationStats::OperationStats() {
+    for (auto& error : errors) {
+        error.store(0, std::memory_order_relaxed);
+    }
+}
+
+void BusStatistics::OperationStats::record(uint64_t us, uint32_t bytes, int error) {
+    latency.record(us);
+    if (error == 0) {
+        this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    } else {
+        errors[classify(error)].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void BusStatistics::OperationStats::recordError(int error) {
+    errors[classify(error)].fetch_add(1, std::memory_order_relaxed);
+}
+
+BusOperationStatsSnapshot BusStatistics::OperationStats::snapshot() const {
+    BusOperationStatsSnapshot snapshot;
+    snapshot.latency = latency.snapshot();
+    snapshot.bytes = bytes.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < BUS_ERROR_CLASS_COUNT; ++i) {
+        snapshot.errors[i] = errors[i].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+BusErrorClass BusStatistics::classify(int error) {
+    switch (error) {
+        case ENXIO:
+        case EREMOTEIO:
+            return BUS_ERROR_NACK;
+        case ETIMEDOUT:
+            return BUS_ERROR_TIMEOUT;
+        case EIO:
+            return BUS_ERROR_IO;
+        case EAGAIN:
+        case EBUSY:
+            return BUS_ERROR_BUSY;
+        case EBADF:
+        case ENODEV:
+            return BUS_ERROR_NO_DEVICE;
+        default:
+            return BUS_ERROR_OTHER;
+    }
+}
+
+void BusStatistics::recordRead(uint64_t us, uint32_t bytes, int error) {
+    reads.record(us, bytes, error);
+}
+
+void BusStatistics::recordWrite(uint64_t us, uint32_t bytes, int error) {
+    writes.record(us, bytes, error);
+}
+
+void BusStatistics::recordReadError(int error) {
+    reads.recordError(error);
+}
+
+void BusStatistics::recordWriteError(int error) {
+    writes.recordError(error);
+}
+
+void BusStatistics::recordClose() {
+    closes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BusStatistics::recordReopen() {
+    reopens.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BusStatistics::recordMuxSwitch() {
+    muxSwitches.fetch_add(1, std::memory_order_relaxed);
+}
+
+BusStatsSnapshot BusStatistics::snapshot() const {
+    return BusStatsSnapshot{
+        reads.snapshot(),
+        writes.snapshot(),
+        closes.load(std::memory_order_relaxed),
+        reopens.load(std::memory_order_relaxed),
+        muxSwitches.load(std::memory_order_relaxed)
+    };
+}
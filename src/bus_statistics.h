@@ -0,0 +1,133 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUS_STATISTICS_H_
+#define BUS_STATISTICS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// HDR style buckets: values below 4 us are exact, above that each power of two
+// is split in 4 linear sub-buckets (25% precision) up to 2^24 us (~16 s).
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 2
+#define LATENCY_HISTOGRAM_MAX_MAGNITUDE 23
+#define LATENCY_HISTOGRAM_BUCKETS ((1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) * LATENCY_HISTOGRAM_MAX_MAGNITUDE)
+
+struct LatencyHistogramSnapshot {
+    uint64_t counts[LATENCY_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t totalUs;
+    uint64_t maxUs;
+
+    /// @brief Upper bound (microseconds) of the bucket holding the given percentile
+    /// @param percentile between 0 and 100
+    uint64_t percentileUs(double percentile) const;
+
+    /// @brief Add the values of another histogram
+    void merge(const LatencyHistogramSnapshot& other);
+};
+
+class LatencyHistogram {
+private:
+    std::atomic<uint64_t> counts[LATENCY_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> totalUs;
+    std::atomic<uint64_t> maxUs;
+
+public:
+    LatencyHistogram();
+
+    static size_t bucketIndex(uint64_t us);
+    static uint64_t bucketUpperBoundUs(size_t index);
+
+    void record(uint64_t us);
+    void reset();
+    LatencyHistogramSnapshot snapshot() const;
+};
+
+enum BusErrorClass {
+    BUS_ERROR_NACK,         // ENXIO, EREMOTEIO: the device didn't acknowledge
+    BUS_ERROR_TIMEOUT,      // ETIMEDOUT
+    BUS_ERROR_IO,           // EIO: arbitration lost, bus error...
+    BUS_ERROR_BUSY,         // EAGAIN, EBUSY
+    BUS_ERROR_NO_DEVICE,    // EBADF, ENODEV: the bus is closed or gone
+    BUS_ERROR_OTHER,
+    BUS_ERROR_CLASS_COUNT
+};
+
+struct BusOperationStatsSnapshot {
+    LatencyHistogramSnapshot latency;
+    uint64_t bytes;
+    uint64_t errors[BUS_ERROR_CLASS_COUNT];
+};
+
+struct BusStatsSnapshot {
+    BusOperationStatsSnapshot reads;
+    BusOperationStatsSnapshot writes;
+    uint64_t closes;        // number of times the bus has been closed after an error
+    uint64_t reopens;       // number of times the bus has been reopened after an error
+    uint64_t muxSwitches;   // number of multiplexer channel switches
+};
+
+/*
+    Lock-free counters of a bus: cheap enough to stay enabled in production,
+    read from any thread through snapshot().
+*/
+
+class BusStatistics {
+private:
+    struct OperationStats {
+        LatencyHistogram latency;
+        std::atomic<uint64_t> bytes {0};
+        std::atomic<uint64_t> errors[BUS_ERROR_CLASS_COUNT];
+
+        OperationStats();
+        void record(uint64_t us, uint32_t bytes, int error);
+        void recordError(int error);
+        BusOperationStatsSnapshot snapshot() const;
+    };
+
+    OperationStats reads;
+    OperationStats writes;
+    std::atomic<uint64_t> closes {0};
+    std::atomic<uint64_t> reopens {0};
+    std::atomic<uint64_t> muxSwitches {0};
+
+public:
+    static BusErrorClass classify(int error);
+
+    /// @brief Record a read transaction
+    /// @param us the transaction duration in microseconds
+    /// @param bytes the number of bytes transferred
+    /// @param error the errno of a failed transaction, 0 on success
+    void recordRead(uint64_t us, uint32_t bytes, int error);
+    void recordWrite(uint64_t us, uint32_t bytes, int error);
+
+    /// @brief Record a transaction that failed before reaching the bus (no latency sample)
+    /// @param error the errno of the failure
+    void recordReadError(int error);
+    void recordWriteError(int error);
+    void recordClose();
+    void recordReopen();
+    void recordMuxSwitch();
+
+    BusStatsSnapshot snapshot() const;
+};
+
+#endif // BUS_STATISTICS_H_
@@ -21,10 +21,35 @@
 
 #define HOMEBRIDGE_URL ""                       // Homebridge URL to publish the data. Example: http://192.168.0.1:8581
 #define HOMEBRIDGE_PUBLISH_INTERVAL 15          // publish interval in seconds
+#define HOMEBRIDGE_TIMEOUT 5                    // timeout of a publish, and of the last publish at shutdown, in seconds
+#define IAQ_SHUTDOWN_TIMEOUT 15                 // seconds given to a graceful shutdown (SIGTERM, SIGINT) before the process exits anyway
 
 #define IAQ_SAVED_STATE_DIR "./saved_state"     // directory to save the IAQ state (will be created if it doesn't exist)
-#define IAQ_SAVED_STATE_FILE "bsec_state_file"  // file to save the IAQ state (will be created if it doesn't exist)
+#define IAQ_SAVED_STATE_FILE "bsec_state_file"  // file to save the IAQ state (will be created if it doesn't exist, suffixed by the name of the sensors given with --sensor)
+#define IAQ_STATE_SAVE_MAX_INTERVAL 30000       // save the IAQ state at least every 30000 seconds (500 minutes, whatever the sample rate), or earlier when the IAQ accuracy improves
+#define IAQ_STATE_SAVE_MIN_INTERVAL 300         // minimum time in seconds between two IAQ state saves (except at shutdown)
+#define IAQ_STATE_GENERATIONS 3                 // saved IAQ states kept (file, file.1, file.2...), the newest valid one is loaded
+#define IAQ_BSEC_CONFIG "33v_3s_4d"             // BSEC configuration (bsec/config/*iaq_<name>), its sample period selects the sample rate
+#define IAQ_RATE_POLICY false                   // switch the BSEC sample rate between LP (3 s) and ULP (300 s) at runtime (--rate-policy)
+#define IAQ_RATE_LP_START_HOUR 7                // local hour from which the rate policy samples at LP
+#define IAQ_RATE_LP_END_HOUR 7                  // local hour from which it samples at ULP again (same as the start hour: no LP hours)
+#define IAQ_RATE_VOLATILITY 20.0f               // IAQ variation within IAQ_RATE_VOLATILITY_WINDOW that switches to LP (someone in the room)
+#define IAQ_RATE_VOLATILITY_WINDOW 900          // seconds (three ULP samples)
+#define IAQ_RATE_CALM_DELAY 1800                // seconds without such a variation before going back to ULP
+#define IAQ_SENSOR_NAME "rpi4"                  // name of the sensor, prefix of its HomeBridge accessory ids
+#define IAQ_SAMPLING_WAKEUP_ADVANCE_US 2000     // wake up this early from the sampling waits, then sleep precisely (clock_nanosleep) to the deadline
+#define IAQ_SAMPLING_OVERRUN_MS 50              // report the sampling steps starting later than this after their deadline
+#define IAQ_SAMPLING_STATS_WINDOW 300           // samples per window of the rolling sample timing percentiles (4 windows: 1 hour at 3 secs per sample)
+#define IAQ_SAMPLING_WORKERS 0                  // threads sampling the sensors (0: one per core, never more than the number of sensors)
 #define IAQ_I2C_BUS_DEVICE "/dev/i2c-1"         // I2C bus device
+#define IAQ_I2C_ADDRESS 0x77                    // I2C address of the sensor (0x76 when SDO is tied to GND)
+#define IAQ_I2C_MUX_CHANNEL -1                  // TCA9548A channel of the sensor (-1 when the sensor is directly on the bus)
+#define IAQ_I2C_MUX_ADDRESS 0x70                // I2C address of the TCA9548A multiplexer
+#define IAQ_I2C_BUS_WORKER false                // do the I2C transfers on a dedicated thread shared by all the sensors (adds two thread handoffs per register access)
+#define IAQ_I2C_REGISTER_SHADOW true            // elide I2C writes of register values the sensor already holds
+#define IAQ_SENSOR_SPI false                    // talk to the sensor over SPI (IAQ_SPI_BUS_DEVICE) instead of I2C
+#define IAQ_SPI_BUS_DEVICE "/dev/spidev0.0"     // SPI device of the sensor chip select
+#define IAQ_SPI_SPEED_HZ 8000000                // SPI clock frequency (10 MHz max)
 #define IAQ_TEMP_OFFSET 9.0f                    // temperature offset in Celsius (depends on the sensor placement and the Raspberry Pi heat)
 
 
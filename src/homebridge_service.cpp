@@ -33,7 +33,6 @@ HomeBridgeService::HomeBridgeService(HomeBridgeServiceConfig config) {
 
 HomeBridgeService::~HomeBridgeService() {
     stop();
-    publishing_thread.join();
 }
 
 void HomeBridgeService::update(const string& sensor_id, double value) {
@@ -49,7 +48,7 @@ void HomeBridgeService::publish(const string& sensor_id, double value) {
         {"accessoryId", sensor_id},
         {"value", to_string(value)}
     };
-    cpr::Response response{cpr::Get(URL, params)};
+    cpr::Response response{cpr::Get(URL, params, cpr::Timeout{chrono::seconds(config.timeout)})};
     if (response.status_code != 200) {
         throw HomeBridgeServiceError(response.text);
     }
@@ -60,32 +59,53 @@ void HomeBridgeService::start() {
     if (running) {
         return;
     }
+    // set before the thread runs: a stop() right after start() is not lost
+    running = true;
     publishing_thread = thread([=]() {
         spdlog::info("[HomeBridgeService] started");
-        running = true;
         while (running) {
-            sensors_map_mutex.lock();
-            for (auto& sensor : next_sensors) {
-                sensors[sensor.first] = sensor.second;
-            }
-            next_sensors.clear();
-            sensors_map_mutex.unlock();
-            for (auto& sensor : sensors) {
-                try {
-                    publish(sensor.first.c_str(), sensor.second);
-                } catch (HomeBridgeServiceError& e) {
-                    spdlog::error("[HomeBridgeService] Error: {}", e.what());
-                } catch (exception& e) {
-                    spdlog::error("[HomeBridgeService] Error: {}", e.what());
-                }
-            }
-            this_thread::sleep_for(chrono::seconds(config.publishInterval));
+            publishSensors(false);
+            unique_lock<mutex> lock(stop_mutex);
+            stop_condition.wait_for(lock, chrono::seconds(config.publishInterval), [this]() { return !running; });
         }
-        running = false;
+        // the values updated since the last publish would be lost
+        publishSensors(true);
         spdlog::info("[HomeBridgeService] stopped");
     });
 }
 
 void HomeBridgeService::stop() {
-    running = false;
-}
\ No newline at end of file
+    {
+        lock_guard<mutex> lock(stop_mutex);
+        running = false;
+    }
+    stop_condition.notify_all();
+    if (publishing_thread.joinable()) {
+        publishing_thread.join();
+    }
+}
+
+void HomeBridgeService::publishSensors(bool pendingOnly) {
+    sensors_map_mutex.lock();
+    map<string, double> pending;
+    pending.swap(next_sensors);
+    sensors_map_mutex.unlock();
+    for (auto& sensor : pending) {
+        sensors[sensor.first] = sensor.second;
+    }
+
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(config.timeout);
+    for (auto& sensor : pendingOnly ? pending : sensors) {
+        if (pendingOnly && chrono::steady_clock::now() > deadline) {
+            spdlog::warn("[HomeBridgeService] Publish timeout, {} not published", sensor.first);
+            continue;
+        }
+        try {
+            publish(sensor.first.c_str(), sensor.second);
+        } catch (HomeBridgeServiceError& e) {
+            spdlog::error("[HomeBridgeService] Error: {}", e.what());
+        } catch (exception& e) {
+            spdlog::error("[HomeBridgeService] Error: {}", e.what());
+        }
+    }
+}
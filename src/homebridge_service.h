@@ -18,6 +18,8 @@
 
 #ifndef HOMEBRIDGE_SERVICE_H_
 #define HOMEBRIDGE_SERVICE_H_
+#include <atomic>
+#include <condition_variable>
 #include <exception>
 #include <string>
 #include <map>
@@ -27,6 +29,7 @@
 struct HomeBridgeServiceConfig {
     std::string url;        // HomeBridge instance URL
     int publishInterval;    // Publish interval in seconds
+    int timeout;            // Timeout of a publish request, and of the last publish when stopped, in seconds
 };
 
 class HomeBridgeServiceError: public std::exception {
@@ -42,13 +45,16 @@ public:
 class HomeBridgeService {
 private:
     HomeBridgeServiceConfig config;
-    bool running;
+    std::atomic<bool> running;
     std::thread publishing_thread;
+    std::mutex stop_mutex;
+    std::condition_variable stop_condition;
     std::mutex sensors_map_mutex;
     std::map<std::string, double> sensors;          // last updated sensors values
     std::map<std::string, double> next_sensors;     // next sensors values to update
     
     void publish(const std::string& sensor_id, double value);
+    void publishSensors(bool pendingOnly);
     
 public:
     HomeBridgeService(HomeBridgeServiceConfig config);
@@ -62,7 +68,7 @@ public:
     /// @brief Start the HomeBridge service
     void start();
 
-    /// @brief Stop the HomeBridge service
+    /// @brief Stop the HomeBridge service, once the values updated since the last publish are published (within the timeout)
     void stop();
 };
 
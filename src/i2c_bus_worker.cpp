@@ -0,0 +1,190 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "i2c_bus_worker.h"
+#include <spdlog/spdlog.h>
+#include <cstring>
+
+using namespace std;
+
+/**********************************************************************************************************************/
+/* I2CBusWorker */
+/**********************************************************************************************************************/
+
+I2CBusWorker::I2CBusWorker(SimpleI2CBus *bus, size_t capacity): bus(bus), capacity(capacity), running(false) {
+}
+
+I2CBusWorker::~I2CBusWorker() {
+    stop();
+}
+
+void I2CBusWorker::start() {
+    lock_guard<mutex> lock(queueMutex);
+    if (running) {
+        return;
+    }
+    running = true;
+    workerThread = thread([this]() {
+        spdlog::info("[I2CBusWorker] started");
+        run();
+        spdlog::info("[I2CBusWorker] stopped");
+    });
+}
+
+void I2CBusWorker::stop() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        running = false;
+    }
+    queueNotEmpty.notify_all();
+    queueNotFull.notify_all();
+    if (workerThread.joinable()) {
+        workerThread.join();
+    }
+}
+
+std::unique_ptr<AsyncI2CDevice> I2CBusWorker::attachDevice(uint8_t slaveAddress, int muxChannel) {
+    unique_ptr<I2CDevice> device = bus->attachDevice(slaveAddress, muxChannel);
+    if (!device) {
+        return nullptr;
+    }
+    return make_unique<AsyncI2CDevice>(this, std::move(device));
+}
+
+std::future<int> I2CBusWorker::read(I2CDevice *device, uint8_t reg_addr, uint8_t *buffer, uint32_t data_len) {
+    auto request = make_unique<Request>();
+    request->type = REQUEST_READ;
+    request->device = device;
+    request->reg = reg_addr;
+    request->length = data_len;
+    request->readBuffer = buffer;
+    return submit(std::move(request));
+}
+
+std::future<int> I2CBusWorker::write(I2CDevice *device, uint8_t reg_addr, const uint8_t *data, uint32_t data_len) {
+    if (data_len > I2C_BUS_MAX_BUFFER_SIZE) {
+        promise<int> failed;
+        failed.set_value(-1);
+        return failed.get_future();
+    }
+    auto request = make_unique<Request>();
+    request->type = REQUEST_WRITE;
+    request->device = device;
+    request->reg = reg_addr;
+    request->length = data_len;
+    request->readBuffer = nullptr;
+    memcpy(request->data, data, data_len);
+    return submit(std::move(request));
+}
+
+std::future<int> I2CBusWorker::writeRegisters(I2CDevice *device, const RegisterWrite *writes, uint32_t count) {
+    if (count * sizeof(RegisterWrite) > I2C_BUS_MAX_BUFFER_SIZE) {
+        promise<int> failed;
+        failed.set_value(-1);
+        return failed.get_future();
+    }
+    auto request = make_unique<Request>();
+    request->type = REQUEST_WRITE_REGISTERS;
+    request->device = device;
+    request->reg = (count > 0) ? writes[0].reg : 0;
+    request->length = count;
+    request->readBuffer = nullptr;
+    memcpy(request->data, writes, count * sizeof(RegisterWrite));
+    return submit(std::move(request));
+}
+
+std::future<int> I2CBusWorker::submit(std::unique_ptr<Request> request) {
+    future<int> result = request->result.get_future();
+    unique_lock<mutex> lock(queueMutex);
+    queueNotFull.wait(lock, [this]() { return queue.size() < capacity || !running; });
+    if (!running) {
+        request->result.set_value(-1);
+        return result;
+    }
+    queue.push_back(std::move(request));
+    lock.unlock();
+    queueNotEmpty.notify_one();
+    return result;
+}
+
+void I2CBusWorker::run() {
+    deque<unique_ptr<Request>> batch;
+    while (true) {
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueNotEmpty.wait(lock, [this]() { return !queue.empty() || !running; });
+            if (queue.empty() && !running) {
+                return;
+            }
+            // take everything queued so far: one lock for the whole batch
+            batch.swap(queue);
+        }
+        queueNotFull.notify_all();
+
+        while (!batch.empty()) {
+            unique_ptr<Request> request = std::move(batch.front());
+            batch.pop_front();
+            process(request);
+        }
+    }
+}
+
+void I2CBusWorker::process(std::unique_ptr<Request>& request) {
+    switch (request->type) {
+        case REQUEST_WRITE:
+            request->result.set_value(request->device->writeData(request->reg, request->data, request->length));
+            break;
+        case REQUEST_WRITE_REGISTERS:
+            request->result.set_value(request->device->writeRegisters(reinterpret_cast<RegisterWrite*>(request->data), request->length));
+            break;
+        case REQUEST_READ:
+            request->result.set_value(request->device->readData(request->reg, request->readBuffer, request->length));
+            break;
+    }
+}
+
+/**********************************************************************************************************************/
+/* AsyncI2CDevice */
+/**********************************************************************************************************************/
+
+AsyncI2CDevice::AsyncI2CDevice(I2CBusWorker *worker, std::unique_ptr<I2CDevice> device): worker(worker), device(std::move(device)) {
+}
+
+int AsyncI2CDevice::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+    return worker->write(device.get(), reg_addr, reg_data_ptr, data_len).get();
+}
+
+int AsyncI2CDevice::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    return worker->writeRegisters(device.get(), writes, count).get();
+}
+
+int AsyncI2CDevice::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+    return worker->read(device.get(), reg_addr, reg_data_ptr, data_len).get();
+}
+
+bool AsyncI2CDevice::isOpened() {
+    return device->isOpened();
+}
+
+RegisterShadow& AsyncI2CDevice::registerShadow() {
+    return device->registerShadow();
+}
+
+BusStatistics& AsyncI2CDevice::statistics() {
+    return device->statistics();
+}
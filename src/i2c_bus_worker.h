@@ -0,0 +1,115 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef I2C_BUS_WORKER_H_
+#define I2C_BUS_WORKER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "simple_i2c_bus.h"
+
+#define I2C_BUS_WORKER_QUEUE_CAPACITY 32    // pending requests before submitters are blocked
+
+class AsyncI2CDevice;
+
+/*
+    Dedicated thread doing all the transfers of a SimpleI2CBus.
+    Requests are queued (bounded) and completed through futures, in the order they were submitted.
+*/
+
+class I2CBusWorker {
+private:
+    enum RequestType {
+        REQUEST_READ,
+        REQUEST_WRITE,
+        REQUEST_WRITE_REGISTERS
+    };
+
+    struct Request {
+        RequestType type;
+        I2CDevice *device;
+        uint8_t reg;
+        uint32_t length;                            // bytes to read / write, or number of registers
+        uint8_t *readBuffer;
+        uint8_t data[I2C_BUS_MAX_BUFFER_SIZE];      // data to write or register/value pairs
+        std::promise<int> result;
+    };
+
+    SimpleI2CBus *bus;
+    size_t capacity;
+    bool running;
+    std::thread workerThread;
+    std::mutex queueMutex;
+    std::condition_variable queueNotEmpty;
+    std::condition_variable queueNotFull;
+    std::deque<std::unique_ptr<Request>> queue;
+
+    std::future<int> submit(std::unique_ptr<Request> request);
+    void run();
+    void process(std::unique_ptr<Request>& request);
+
+public:
+    /// @brief Create a worker for a bus (the bus must outlive the worker)
+    I2CBusWorker(SimpleI2CBus *bus, size_t capacity = I2C_BUS_WORKER_QUEUE_CAPACITY);
+    ~I2CBusWorker();
+
+    void start();
+
+    /// @brief Stop the worker once the queued requests are done
+    void stop();
+
+    /// @brief Get a handle to a device whose transfers go through the worker (nullptr if the channel is out of range)
+    std::unique_ptr<AsyncI2CDevice> attachDevice(uint8_t slaveAddress, int muxChannel = I2C_BUS_NO_MUX_CHANNEL);
+
+    /// @brief Queue a register read, buffer must stay valid until the future is ready
+    std::future<int> read(I2CDevice *device, uint8_t reg_addr, uint8_t *buffer, uint32_t data_len);
+
+    /// @brief Queue a burst write (the data is copied)
+    std::future<int> write(I2CDevice *device, uint8_t reg_addr, const uint8_t *data, uint32_t data_len);
+
+    /// @brief Queue a batch of register writes (the pairs are copied)
+    std::future<int> writeRegisters(I2CDevice *device, const RegisterWrite *writes, uint32_t count);
+};
+
+/*
+    Synchronous view of a device served by an I2CBusWorker: the calling thread waits for its
+    own requests only, while other devices of the bus keep being served.
+*/
+
+class AsyncI2CDevice final: public SensorBus {
+private:
+    I2CBusWorker *worker;
+    std::unique_ptr<I2CDevice> device;
+
+public:
+    AsyncI2CDevice(I2CBusWorker *worker, std::unique_ptr<I2CDevice> device);
+
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
+    bool isOpened() override;
+    RegisterShadow& registerShadow() override;
+    BusStatistics& statistics() override;
+};
+
+#endif // I2C_BUS_WORKER_H_
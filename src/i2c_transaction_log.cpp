@@ -0,0 +1,269 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "i2c_transaction_log.h"
+#include <spdlog/spdlog.h>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define I2C_TRANSACTION_LOG_BUFFER_SIZE (64 * 1024)
+
+/**********************************************************************************************************************/
+/* I2CTransactionRecorder */
+/**********************************************************************************************************************/
+
+I2CTransactionRecorder::I2CTransactionRecorder(std::unique_ptr<SensorBus> bus, const std::string& path, std::function<int64_t()> nowUs)
+    : bus(std::move(bus)), nowUs(nowUs) {
+    file = fopen(path.c_str(), "a+b");
+    if (file == nullptr) {
+        spdlog::error("[I2CTransactionRecorder] Failed to open {}: {}", path, strerror(errno));
+        return;
+    }
+    setvbuf(file, nullptr, _IOFBF, I2C_TRANSACTION_LOG_BUFFER_SIZE);
+
+    // a new log starts with its header, an existing one is appended to if it has the same format
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+        I2CTransactionLogHeader header{I2C_TRANSACTION_LOG_MAGIC, I2C_TRANSACTION_LOG_VERSION, (uint16_t)this->bus->busInterface()};
+        fwrite(&header, sizeof(header), 1, file);
+    } else {
+        I2CTransactionLogHeader header;
+        rewind(file);
+        if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != I2C_TRANSACTION_LOG_MAGIC
+            || header.version != I2C_TRANSACTION_LOG_VERSION) {
+            spdlog::error("[I2CTransactionRecorder] {} is not a transaction log of version {}, not recording", path, I2C_TRANSACTION_LOG_VERSION);
+            fclose(file);
+            file = nullptr;
+            return;
+        }
+        fseek(file, 0, SEEK_END);
+    }
+    spdlog::info("[I2CTransactionRecorder] recording to {}", path);
+}
+
+I2CTransactionRecorder::~I2CTransactionRecorder() {
+    if (file != nullptr) {
+        fclose(file);
+    }
+}
+
+void I2CTransactionRecorder::record(uint8_t operation, uint8_t reg, const uint8_t *payload, uint32_t length, int result) {
+    if (file == nullptr) {
+        return;
+    }
+    I2CTransactionRecord record;
+    record.timestampUs = nowUs();
+    record.operation = operation;
+    record.reg = reg;
+    record.length = length;
+    record.result = result;
+    if (fwrite(&record, sizeof(record), 1, file) != 1 || fwrite(payload, 1, length, file) != length) {
+        spdlog::error("[I2CTransactionRecorder] Failed to write the transaction log, recording stopped");
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+void I2CTransactionRecorder::markSample(int64_t timestampNs) {
+    if (file == nullptr) {
+        return;
+    }
+    // a crash loses at most the sampling step in progress
+    fflush(file);
+    record(I2C_TRANSACTION_SAMPLE, 0, reinterpret_cast<const uint8_t*>(&timestampNs), sizeof(timestampNs), 0);
+}
+
+int I2CTransactionRecorder::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+    int ret = bus->writeData(reg_addr, reg_data_ptr, data_len);
+    record(I2C_TRANSACTION_WRITE, reg_addr, reg_data_ptr, data_len, ret);
+    return ret;
+}
+
+int I2CTransactionRecorder::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    int ret = bus->writeRegisters(writes, count);
+    uint8_t reg = (count > 0) ? writes[0].reg : 0;
+    record(I2C_TRANSACTION_WRITE_REGISTERS, reg, reinterpret_cast<const uint8_t*>(writes), count * sizeof(RegisterWrite), ret);
+    return ret;
+}
+
+int I2CTransactionRecorder::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+    int ret = bus->readData(reg_addr, reg_data_ptr, data_len);
+    record(I2C_TRANSACTION_READ, reg_addr, reg_data_ptr, data_len, ret);
+    return ret;
+}
+
+bool I2CTransactionRecorder::isOpened() {
+    return bus->isOpened();
+}
+
+SensorBusInterface I2CTransactionRecorder::busInterface() {
+    return bus->busInterface();
+}
+
+RegisterShadow& I2CTransactionRecorder::registerShadow() {
+    return bus->registerShadow();
+}
+
+BusStatistics& I2CTransactionRecorder::statistics() {
+    return bus->statistics();
+}
+
+/**********************************************************************************************************************/
+/* I2CReplayBus */
+/**********************************************************************************************************************/
+
+I2CReplayBus::I2CReplayBus(const std::string& path, std::function<void()> onEndOfLog)
+    : data(nullptr), size(0), offset(0), recordIndex(0), onEndOfLog(onEndOfLog), interface(SensorBusInterface::I2C) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        spdlog::error("[I2CReplayBus] Failed to open {}: {}", path, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(I2CTransactionLogHeader)) {
+        spdlog::error("[I2CReplayBus] {} is not a transaction log", path);
+        close(fd);
+        return;
+    }
+
+    // The log is mapped rather than loaded so multi-day captures don't have to fit in RAM
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        spdlog::error("[I2CReplayBus] Failed to map {}: {}", path, strerror(errno));
+        return;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    I2CTransactionLogHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    if (header.magic != I2C_TRANSACTION_LOG_MAGIC || header.version < 1 || header.version > I2C_TRANSACTION_LOG_VERSION) {
+        spdlog::error("[I2CReplayBus] {} has an unsupported format (magic: {:#x}, version: {})", path, header.magic, header.version);
+        munmap(mapping, st.st_size);
+        return;
+    }
+
+    data = static_cast<const uint8_t*>(mapping);
+    size = st.st_size;
+    offset = sizeof(header);
+    interface = (header.interface == (uint16_t)SensorBusInterface::SPI) ? SensorBusInterface::SPI : SensorBusInterface::I2C;
+    spdlog::info("[I2CReplayBus] replaying {} ({} bytes)", path, size);
+}
+
+I2CReplayBus::~I2CReplayBus() {
+    if (data != nullptr) {
+        munmap(const_cast<uint8_t*>(data), size);
+    }
+}
+
+const I2CTransactionRecord* I2CReplayBus::next(uint8_t operation, uint8_t reg, const uint8_t *payload, uint32_t length) {
+    if (!isOpened()) {
+        return nullptr;
+    }
+    // the start of a step the owner doesn't follow (nextSample) has nothing to serve: skipped
+    const I2CTransactionRecord *record = nullptr;
+    while (true) {
+        if (offset + sizeof(I2CTransactionRecord) > size) {
+            spdlog::info("[I2CReplayBus] end of the transaction log after {} records", recordIndex);
+            endReplay();
+            return nullptr;
+        }
+        record = reinterpret_cast<const I2CTransactionRecord*>(data + offset);
+        if (offset + sizeof(I2CTransactionRecord) + record->length > size) {
+            spdlog::warn("[I2CReplayBus] truncated record {}", recordIndex);
+            endReplay();
+            return nullptr;
+        }
+        if (record->operation != I2C_TRANSACTION_SAMPLE) {
+            break;
+        }
+        offset += sizeof(I2CTransactionRecord) + record->length;
+        ++recordIndex;
+    }
+    // nothing the driver does after a divergence can be served from the log
+    if (record->operation != operation || record->reg != reg || record->length != length) {
+        spdlog::error("[I2CReplayBus] replay diverged at record {}: got op={} reg={:#x} len={}, expected op={} reg={:#x} len={}",
+            recordIndex, operation, reg, length, record->operation, record->reg, record->length);
+        endReplay();
+        return nullptr;
+    }
+    if (payload != nullptr && memcmp(record + 1, payload, length) != 0) {
+        spdlog::error("[I2CReplayBus] replay diverged at record {}: op={} reg={:#x} len={} writes other data than recorded", recordIndex, operation, reg, length);
+        endReplay();
+        return nullptr;
+    }
+
+    offset += sizeof(I2CTransactionRecord) + record->length;
+    ++recordIndex;
+    return record;
+}
+
+bool I2CReplayBus::nextSample(int64_t *timestampNs) {
+    if (!isOpened() || offset + sizeof(I2CTransactionRecord) > size) {
+        return false;
+    }
+    const I2CTransactionRecord *record = reinterpret_cast<const I2CTransactionRecord*>(data + offset);
+    if (record->operation != I2C_TRANSACTION_SAMPLE || record->length != sizeof(int64_t)
+        || offset + sizeof(I2CTransactionRecord) + record->length > size) {
+        return false;
+    }
+    memcpy(timestampNs, record + 1, sizeof(int64_t));
+    offset += sizeof(I2CTransactionRecord) + record->length;
+    ++recordIndex;
+    return true;
+}
+
+void I2CReplayBus::endReplay() {
+    offset = size;
+    if (onEndOfLog) {
+        onEndOfLog();
+    }
+}
+
+int I2CReplayBus::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+    const I2CTransactionRecord *record = next(I2C_TRANSACTION_WRITE, reg_addr, reg_data_ptr, data_len);
+    return (record == nullptr) ? -1 : record->result;
+}
+
+int I2CReplayBus::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    uint8_t reg = (count > 0) ? writes[0].reg : 0;
+    const I2CTransactionRecord *record = next(I2C_TRANSACTION_WRITE_REGISTERS, reg, reinterpret_cast<const uint8_t*>(writes), count * sizeof(RegisterWrite));
+    return (record == nullptr) ? -1 : record->result;
+}
+
+int I2CReplayBus::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+    const I2CTransactionRecord *record = next(I2C_TRANSACTION_READ, reg_addr, nullptr, data_len);
+    if (record == nullptr) {
+        return -1;
+    }
+    memcpy(reg_data_ptr, record + 1, data_len);
+    return record->result;
+}
+
+bool I2CReplayBus::isOpened() {
+    return data != nullptr && offset < size;
+}
+
+SensorBusInterface I2CReplayBus::busInterface() {
+    return interface;
+}
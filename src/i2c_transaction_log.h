@@ -0,0 +1,137 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef I2C_TRANSACTION_LOG_H_
+#define I2C_TRANSACTION_LOG_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include "sensor_bus.h"
+
+/*
+    Transaction log file format (little endian, append-only):
+    - one I2CTransactionLogHeader
+    - a sequence of I2CTransactionRecord, each followed by `length` payload bytes
+      (the data read, the data written, the register/value pairs of a batch, or the
+      timestamp of a sampling step)
+    Records are packed back to back so the file can be streamed or mapped and walked in place.
+*/
+
+#define I2C_TRANSACTION_LOG_MAGIC 0x4C433249   // "I2CL"
+#define I2C_TRANSACTION_LOG_VERSION 2       // 1: wall clock timestamps, no sampling steps
+
+enum I2CTransactionOperation: uint8_t {
+    I2C_TRANSACTION_READ = 1,
+    I2C_TRANSACTION_WRITE = 2,
+    I2C_TRANSACTION_WRITE_REGISTERS = 3,
+    I2C_TRANSACTION_SAMPLE = 4              // start of a sampling step, the payload is the int64_t time given to BSEC (nanoseconds)
+};
+
+#pragma pack(push, 1)
+struct I2CTransactionLogHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t interface;     // SensorBusInterface of the recorded bus (0, I2C, in logs made before SPI support)
+};
+
+struct I2CTransactionRecord {
+    int64_t timestampUs;    // time of the transaction on the sampling clock (microseconds)
+    uint8_t operation;      // I2CTransactionOperation
+    uint8_t reg;            // register address (first register of a batch)
+    uint16_t length;        // payload length in bytes
+    int32_t result;         // value returned to the driver
+};
+#pragma pack(pop)
+
+/*
+    Bus decorator logging every transaction of the wrapped bus to a transaction log file.
+*/
+
+class I2CTransactionRecorder final: public SensorBus {
+private:
+    std::unique_ptr<SensorBus> bus;
+    FILE *file;
+    std::function<int64_t()> nowUs;
+
+    void record(uint8_t operation, uint8_t reg, const uint8_t *payload, uint32_t length, int result);
+
+public:
+    /// @brief Record the transactions of a bus
+    /// @param bus the bus doing the actual transactions
+    /// @param path the log file (appended to if it already exists)
+    /// @param nowUs the sampling clock (microseconds)
+    I2CTransactionRecorder(std::unique_ptr<SensorBus> bus, const std::string& path, std::function<int64_t()> nowUs);
+    ~I2CTransactionRecorder();
+
+    /// @brief Record the start of a sampling step, once the transactions of the previous one are on disk
+    /// @param timestampNs the time given to BSEC for this step (nanoseconds)
+    void markSample(int64_t timestampNs);
+
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
+    bool isOpened() override;
+    SensorBusInterface busInterface() override;
+    RegisterShadow& registerShadow() override;
+    BusStatistics& statistics() override;
+};
+
+/*
+    Bus serving the transactions of a log file back to the driver, in order and without hardware.
+    Any request that doesn't match the next record (operation, register, length and data written)
+    is reported as a divergence: it fails and ends the replay.
+*/
+
+class I2CReplayBus final: public SensorBus {
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    uint64_t recordIndex;
+    std::function<void()> onEndOfLog;
+    SensorBusInterface interface;
+
+    const I2CTransactionRecord* next(uint8_t operation, uint8_t reg, const uint8_t *payload, uint32_t length);
+    void endReplay();
+
+public:
+    /// @brief Replay a transaction log
+    /// @param path the log file
+    /// @param onEndOfLog called once when the replay ends: the driver asked for more than what was recorded,
+    /// a record is truncated or the driver diverged from the log
+    I2CReplayBus(const std::string& path, std::function<void()> onEndOfLog = nullptr);
+    ~I2CReplayBus();
+
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
+    bool isOpened() override;
+
+    /// @brief Interface of the recorded bus
+    SensorBusInterface busInterface() override;
+
+    /// @brief Read the start of the next sampling step
+    /// @param timestampNs the time the recorded step gave to BSEC (nanoseconds)
+    /// @return false if the next record isn't the start of a step (logs of version 1)
+    bool nextSample(int64_t *timestampNs);
+};
+
+#endif // I2C_TRANSACTION_LOG_H_
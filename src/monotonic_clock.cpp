@@ -0,0 +1,49 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "monotonic_clock.h"
+#include <cerrno>
+#include <chrono>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000LL
+
+int64_t MonotonicClock::nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+void MonotonicClock::sleepUntilNs(int64_t deadlineNs) {
+    struct timespec deadline;
+    deadline.tv_sec = deadlineNs / NS_PER_SECOND;
+    deadline.tv_nsec = deadlineNs % NS_PER_SECOND;
+
+    // the deadline is absolute: an interrupted sleep simply resumes with the same one
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {
+    }
+}
+
+void MonotonicClock::waitUntilNs(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, int64_t deadlineNs) {
+    // steady_clock is CLOCK_MONOTONIC
+    condition.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadlineNs)));
+}
+
+bool MonotonicClock::isVirtual() {
+    return false;
+}
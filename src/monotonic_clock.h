@@ -0,0 +1,38 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MONOTONIC_CLOCK_H_
+#define MONOTONIC_CLOCK_H_
+
+#include "sampling_clock.h"
+
+/*
+    Real time base of the sampling: CLOCK_MONOTONIC, which NTP can slew but never step, so
+    BSEC never sees time going backwards or jumping. Sleeps are to absolute deadlines:
+    a late wake-up or a signal doesn't push the following deadlines back.
+*/
+
+class MonotonicClock final : public SamplingClock {
+public:
+    int64_t nowNs() override;
+    void sleepUntilNs(int64_t deadlineNs) override;
+    void waitUntilNs(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, int64_t deadlineNs) override;
+    bool isVirtual() override;
+};
+
+#endif // MONOTONIC_CLOCK_H_
@@ -0,0 +1,96 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "register_shadow.h"
+#include <cstring>
+
+RegisterShadow::RegisterShadow() : enabled(false), writeHits(0), writeMisses(0), readHits(0), readMisses(0) {
+    memset(values, 0, sizeof(values));
+}
+
+void RegisterShadow::setEnabled(bool enabled) {
+    this->enabled = enabled;
+    known.reset();
+}
+
+bool RegisterShadow::isEnabled() const {
+    return enabled;
+}
+
+void RegisterShadow::markVolatile(uint8_t reg) {
+    volatileRegisters.set(reg);
+    known.reset(reg);
+}
+
+void RegisterShadow::invalidate() {
+    known.reset();
+}
+
+void RegisterShadow::invalidate(uint8_t reg, uint32_t len) {
+    for (uint32_t i = 0; i < len && reg + i < 256; ++i) {
+        known.reset(reg + i);
+    }
+}
+
+bool RegisterShadow::canElideWrite(uint8_t reg, uint8_t value) {
+    if (!enabled) {
+        return false;
+    }
+    if (volatileRegisters.test(reg)) {
+        writeMisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (known.test(reg) && values[reg] == value) {
+        writeHits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    writeMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void RegisterShadow::commitWrite(uint8_t reg, uint8_t value) {
+    if (!enabled || volatileRegisters.test(reg)) {
+        return;
+    }
+    values[reg] = value;
+    known.set(reg);
+}
+
+bool RegisterShadow::read(uint8_t reg, uint8_t *data, uint32_t len) {
+    if (!enabled) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        if (reg + i >= 256 || !known.test(reg + i) || volatileRegisters.test(reg + i)) {
+            readMisses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    memcpy(data, values + reg, len);
+    readHits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+RegisterShadowStats RegisterShadow::stats() const {
+    return RegisterShadowStats{
+        writeHits.load(std::memory_order_relaxed),
+        writeMisses.load(std::memory_order_relaxed),
+        readHits.load(std::memory_order_relaxed),
+        readMisses.load(std::memory_order_relaxed)
+    };
+}
@@ -0,0 +1,80 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REGISTER_SHADOW_H_
+#define REGISTER_SHADOW_H_
+
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+
+struct RegisterShadowStats {
+    uint64_t writeHits;     // register writes elided because the device already holds the value
+    uint64_t writeMisses;   // register writes sent to the device
+    uint64_t readHits;      // register reads served from the shadow
+    uint64_t readMisses;    // register reads sent to the device
+};
+
+/*
+    Write-through copy of the registers written to a device with 8 bit register addresses.
+    Registers the device can change on its own (status, mode...) must be marked volatile:
+    they are never elided nor served from the shadow.
+*/
+
+class RegisterShadow {
+private:
+    bool enabled;
+    uint8_t values[256];
+    std::bitset<256> known;
+    std::bitset<256> volatileRegisters;
+    std::atomic<uint64_t> writeHits;
+    std::atomic<uint64_t> writeMisses;
+    std::atomic<uint64_t> readHits;
+    std::atomic<uint64_t> readMisses;
+
+public:
+    RegisterShadow();
+
+    /// @brief Enable or disable the shadow (disabled by default). Disabling it forgets all values.
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+    /// @brief Mark a register as volatile: it is always written and read through
+    void markVolatile(uint8_t reg);
+
+    /// @brief Forget all known values (after a reset or when the bus is reopened)
+    void invalidate();
+
+    /// @brief Forget the known values of a register range
+    void invalidate(uint8_t reg, uint32_t len);
+
+    /// @brief Check if a write is redundant
+    /// @return true if the device already holds this value and the write can be elided
+    bool canElideWrite(uint8_t reg, uint8_t value);
+
+    /// @brief Record a value the device holds from now on (once its write succeeded)
+    void commitWrite(uint8_t reg, uint8_t value);
+
+    /// @brief Serve a read from the shadow if every register is known and not volatile
+    /// @return true if data has been filled from the shadow
+    bool read(uint8_t reg, uint8_t *data, uint32_t len);
+
+    RegisterShadowStats stats() const;
+};
+
+#endif // REGISTER_SHADOW_H_
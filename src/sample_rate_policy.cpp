@@ -0,0 +1,77 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sample_rate_policy.h"
+#include <time.h>
+#include <algorithm>
+#include "bsec_datatypes.h"
+
+SampleRatePolicy::SampleRatePolicy(SampleRatePolicyConfig config)
+    : config(config), lastMovingNs(0), wallOffsetNs(INT64_MIN) {
+}
+
+float SampleRatePolicy::update(const AirQuality& airQuality) {
+    int64_t timestampNs = airQuality.timestampNs;
+    // the schedule follows the wall clock, even when the sampling clock is virtual
+    if (wallOffsetNs == INT64_MIN) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        wallOffsetNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - timestampNs;
+    }
+
+    // IAQ 0 is output while BSEC stabilizes: it doesn't tell anything about the room
+    if (airQuality.iaq_accuracy > 0 || airQuality.iaq > 0) {
+        iaqHistory.emplace_back(timestampNs, airQuality.iaq);
+    }
+    while (!iaqHistory.empty() && iaqHistory.front().first < timestampNs - config.volatilityWindowS * 1000000000LL) {
+        iaqHistory.pop_front();
+    }
+    if (iaqMoving()) {
+        lastMovingNs = timestampNs;
+    }
+
+    bool occupied = lastMovingNs != 0 && timestampNs - lastMovingNs < config.calmDelayS * 1000000000LL;
+    return (occupied || scheduled(timestampNs)) ? BSEC_SAMPLE_RATE_LP : BSEC_SAMPLE_RATE_ULP;
+}
+
+/**********************************************************************************************************************/
+/* SampleRatePolicy Private Implementation */
+/**********************************************************************************************************************/
+
+bool SampleRatePolicy::scheduled(int64_t timestampNs) {
+    if (config.lpStartHour == config.lpEndHour) {
+        return false;
+    }
+    time_t wall = (time_t)((timestampNs + wallOffsetNs) / 1000000000LL);
+    struct tm local;
+    localtime_r(&wall, &local);
+    if (config.lpStartHour < config.lpEndHour) {
+        return local.tm_hour >= config.lpStartHour && local.tm_hour < config.lpEndHour;
+    }
+    // the LP hours span midnight
+    return local.tm_hour >= config.lpStartHour || local.tm_hour < config.lpEndHour;
+}
+
+bool SampleRatePolicy::iaqMoving() {
+    if (iaqHistory.size() < 2) {
+        return false;
+    }
+    auto range = std::minmax_element(iaqHistory.begin(), iaqHistory.end(),
+        [](const std::pair<int64_t, float>& a, const std::pair<int64_t, float>& b) { return a.second < b.second; });
+    return range.second->second - range.first->second >= config.iaqVolatility;
+}
@@ -0,0 +1,60 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLE_RATE_POLICY_H_
+#define SAMPLE_RATE_POLICY_H_
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include "air_quality.h"
+
+struct SampleRatePolicyConfig {
+    int lpStartHour;            // local hour from which the sensor samples at LP (schedule)
+    int lpEndHour;              // local hour from which it samples at ULP again (equal to lpStartHour: no schedule)
+    float iaqVolatility;        // IAQ variation over volatilityWindowS that switches to LP (occupancy)
+    int volatilityWindowS;
+    int calmDelayS;             // time without such a variation before going back to ULP
+};
+
+/*
+    Choice of the BSEC sample rate of a sensor, LP (3 s) or ULP (300 s), after every sample.
+    LP is wanted during the scheduled hours and while the IAQ moves (someone is in the room),
+    ULP otherwise: an unoccupied room is sampled a hundred times less often.
+*/
+
+class SampleRatePolicy {
+private:
+    SampleRatePolicyConfig config;
+    std::deque<std::pair<int64_t, float>> iaqHistory;   // timestamps and IAQ of the volatility window
+    int64_t lastMovingNs;                               // last time the IAQ moved by iaqVolatility (0: never)
+    int64_t wallOffsetNs;                               // CLOCK_REALTIME minus the sampling clock
+
+    bool scheduled(int64_t timestampNs);
+    bool iaqMoving();
+
+public:
+    SampleRatePolicy(SampleRatePolicyConfig config);
+
+    /// @brief Record a sample and choose the sample rate
+    /// @param airQuality the BSEC outputs of the sample (timestampNs on the sampling clock)
+    /// @return BSEC_SAMPLE_RATE_LP or BSEC_SAMPLE_RATE_ULP
+    float update(const AirQuality& airQuality);
+};
+
+#endif // SAMPLE_RATE_POLICY_H_
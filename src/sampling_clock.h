@@ -0,0 +1,53 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLING_CLOCK_H_
+#define SAMPLING_CLOCK_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/*
+    Time source of the sampling: the BSEC timestamps, the driver delays and the waits
+    between the sampling steps all go through it. MonotonicClock is the real time,
+    VirtualClock runs simulations faster than real time.
+*/
+
+class SamplingClock {
+public:
+    virtual ~SamplingClock() = default;
+
+    /// @brief Current time (nanoseconds)
+    virtual int64_t nowNs() = 0;
+
+    /// @brief Sleep until the given time (returns at once if it is already past)
+    /// @param deadlineNs the time to wake up (nanoseconds)
+    virtual void sleepUntilNs(int64_t deadlineNs) = 0;
+
+    /// @brief Wait on a condition variable until it is notified or the given time is reached
+    /// @param condition the condition variable to wait on
+    /// @param lock the lock of the condition variable, held by the caller
+    /// @param deadlineNs the end of the wait (nanoseconds)
+    virtual void waitUntilNs(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, int64_t deadlineNs) = 0;
+
+    /// @brief Check if the time only advances when waited for (it must then not be waited for while another thread still has work to do at the current time)
+    virtual bool isVirtual() = 0;
+};
+
+#endif // SAMPLING_CLOCK_H_
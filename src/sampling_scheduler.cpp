@@ -0,0 +1,155 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sampling_scheduler.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include "air_quality_service.h"
+#include "constants.h"
+#include "sampling_clock.h"
+
+SamplingScheduler::SamplingScheduler(SamplingClock& clock, unsigned int workerCount)
+    : clock(clock), workerCount(workerCount), activeServices(0), stopping(false), stopAtNs(INT64_MAX) {
+    if (this->workerCount == 0) {
+        this->workerCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+SamplingScheduler::~SamplingScheduler() {
+    stop();
+    for (auto& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+void SamplingScheduler::add(AirQualityService *service) {
+    service->setClock(&clock);
+    services.push_back(service);
+}
+
+void SamplingScheduler::stopAt(int64_t timeNs) {
+    stopAtNs = timeNs;
+}
+
+int SamplingScheduler::run() {
+    // The sensors are initialized without the lock: a stop during the startup must not wait for it
+    int failed = 0;
+    std::vector<AirQualityService*> started;
+    for (AirQualityService *service : services) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (stopping) {
+                break;
+            }
+        }
+        if (service->start() != 0) {
+            ++failed;
+            continue;
+        }
+        started.push_back(service);
+    }
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        for (AirQualityService *service : started) {
+            queue.push(Task{clock.nowNs(), service});
+            ++activeServices;
+        }
+    }
+
+    unsigned int count = std::min<unsigned int>(workerCount, activeServices);
+    spdlog::info("[SamplingScheduler] sampling {} sensors on {} workers", activeServices, count);
+    for (unsigned int i = 0; i < count; ++i) {
+        workers.emplace_back(&SamplingScheduler::work, this);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    // whatever is left in the queue was stopped with the scheduler
+    while (!queue.empty()) {
+        queue.top().service->finish();
+        queue.pop();
+    }
+    spdlog::info("[SamplingScheduler] stopped");
+    return failed;
+}
+
+void SamplingScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+}
+
+/**********************************************************************************************************************/
+/* SamplingScheduler Private Implementation */
+/**********************************************************************************************************************/
+
+void SamplingScheduler::work() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (!stopping && activeServices > 0) {
+        if (queue.empty()) {
+            // every service is being sampled by another worker
+            queueChanged.wait(lock);
+            continue;
+        }
+
+        Task task = queue.top();
+        if (task.deadlineNs >= stopAtNs) {
+            spdlog::info("[SamplingScheduler] end of the sampling time");
+            stopping = true;
+            queueChanged.notify_all();
+            break;
+        }
+
+        // Wait until just before the earliest deadline: an earlier task may be queued while
+        // waiting, the wait is interrupted by every push
+        int64_t wakeup_ns = task.deadlineNs - IAQ_SAMPLING_WAKEUP_ADVANCE_US * 1000;
+        if (wakeup_ns > clock.nowNs()) {
+            if (clock.isVirtual() && queue.size() < activeServices) {
+                // virtual time must not pass a step still being sampled: it can queue an earlier deadline
+                queueChanged.wait(lock);
+            } else {
+                clock.waitUntilNs(queueChanged, lock, wakeup_ns);
+            }
+            continue;
+        }
+        queue.pop();
+
+        // the condition variable wake-up latency is compensated by sleeping precisely to the deadline
+        lock.unlock();
+        clock.sleepUntilNs(task.deadlineNs);
+        int64_t next_ns = task.service->sample(clock.nowNs());
+        bool done = task.service->isStopping();
+        if (done) {
+            task.service->finish();
+        }
+        lock.lock();
+
+        if (done) {
+            --activeServices;
+        } else {
+            queue.push(Task{next_ns, task.service});
+        }
+        queueChanged.notify_all();
+    }
+}
@@ -0,0 +1,86 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLING_SCHEDULER_H_
+#define SAMPLING_SCHEDULER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class AirQualityService;
+class SamplingClock;
+
+/*
+    Runs the sampling steps of several sensors on a small pool of worker threads.
+    Services are served earliest deadline first and each one is handled by a single worker
+    at a time, so the BSEC processing of different sensors overlaps on the Pi cores while the
+    bus accesses stay serialized by the buses themselves. Measurements are collected by a
+    later task instead of sleeping in a worker, so a worker is never blocked on a sensor.
+*/
+
+class SamplingScheduler {
+private:
+    struct Task {
+        int64_t deadlineNs;
+        AirQualityService *service;
+
+        bool operator>(const Task& other) const {
+            return deadlineNs > other.deadlineNs;
+        }
+    };
+
+    SamplingClock& clock;
+    std::vector<AirQualityService*> services;
+    unsigned int workerCount;
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::priority_queue<Task, std::vector<Task>, std::greater<Task>> queue;
+    unsigned int activeServices;              // services queued or being sampled
+    bool stopping;
+    int64_t stopAtNs;
+
+    void work();
+
+public:
+    /// @brief Create a scheduler
+    /// @param clock the time source of the sampling, given to the services
+    /// @param workerCount the number of worker threads (0: one per core), capped by the number of services
+    SamplingScheduler(SamplingClock& clock, unsigned int workerCount = 0);
+    ~SamplingScheduler();
+
+    /// @brief Add a service to run (must be called before run)
+    void add(AirQualityService *service);
+
+    /// @brief Stop the services once the clock reaches the given time (must be called before run)
+    /// @param timeNs the end of the sampling (nanoseconds)
+    void stopAt(int64_t timeNs);
+
+    /// @brief Start the services and sample them until they are all stopped or stop is called
+    /// @return the number of services that could not be started
+    int run();
+
+    /// @brief Stop all the services and make run return (can be called from any thread)
+    void stop();
+};
+
+#endif // SAMPLING_SCHEDULER_H_
@@ -0,0 +1,66 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sampling_statistics.h"
+
+void SamplingStatistics::Window::reset() {
+    lateness.reset();
+    bus.reset();
+    bsec.reset();
+    callback.reset();
+}
+
+SamplingStatistics::SamplingStatistics(uint32_t samplesPerWindow): samplesPerWindow(samplesPerWindow), windowSamples(0) {
+    if (this->samplesPerWindow == 0) {
+        this->samplesPerWindow = 1;
+    }
+}
+
+void SamplingStatistics::record(const SampleTiming& timing) {
+    uint32_t index = current.load(std::memory_order_relaxed);
+    if (windowSamples >= samplesPerWindow) {
+        // the oldest window becomes the new one
+        index = (index + 1) % SAMPLING_STATISTICS_WINDOWS;
+        windows[index].reset();
+        current.store(index, std::memory_order_relaxed);
+        windowSamples = 0;
+    }
+    Window& window = windows[index];
+    window.lateness.record(timing.latenessUs);
+    window.bus.record(timing.busUs);
+    window.bsec.record(timing.bsecUs);
+    window.callback.record(timing.callbackUs);
+    ++windowSamples;
+    samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+SamplingStatsSnapshot SamplingStatistics::snapshot() const {
+    SamplingStatsSnapshot snapshot;
+    snapshot.lateness = windows[0].lateness.snapshot();
+    snapshot.bus = windows[0].bus.snapshot();
+    snapshot.bsec = windows[0].bsec.snapshot();
+    snapshot.callback = windows[0].callback.snapshot();
+    for (size_t i = 1; i < SAMPLING_STATISTICS_WINDOWS; ++i) {
+        snapshot.lateness.merge(windows[i].lateness.snapshot());
+        snapshot.bus.merge(windows[i].bus.snapshot());
+        snapshot.bsec.merge(windows[i].bsec.snapshot());
+        snapshot.callback.merge(windows[i].callback.snapshot());
+    }
+    snapshot.samples = samples.load(std::memory_order_relaxed);
+    return snapshot;
+}
@@ -0,0 +1,79 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLING_STATISTICS_H_
+#define SAMPLING_STATISTICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include "bus_statistics.h"
+
+// The percentiles cover the last SAMPLING_STATISTICS_WINDOWS windows of samples:
+// the oldest window is dropped whenever a new one starts.
+#define SAMPLING_STATISTICS_WINDOWS 4
+
+/// @brief Timing of one BSEC sample, from its sensor control to the processing of its measurement
+struct SampleTiming {
+    uint64_t latenessUs;    // start of the sample after its scheduled time
+    uint64_t busUs;         // time spent in the sensor bus transfers
+    uint64_t bsecUs;        // time spent in bsec_sensor_control and bsec_do_steps
+    uint64_t callbackUs;    // time spent handling the outputs on the sampling thread
+};
+
+struct SamplingStatsSnapshot {
+    LatencyHistogramSnapshot lateness;
+    LatencyHistogramSnapshot bus;
+    LatencyHistogramSnapshot bsec;
+    LatencyHistogramSnapshot callback;
+    uint64_t samples;       // number of samples recorded since the start (not only in the windows)
+};
+
+/*
+    Rolling timing percentiles of the samples of a sensor, recorded by the thread sampling it
+    and read from any thread through snapshot().
+*/
+
+class SamplingStatistics {
+private:
+    struct Window {
+        LatencyHistogram lateness;
+        LatencyHistogram bus;
+        LatencyHistogram bsec;
+        LatencyHistogram callback;
+
+        void reset();
+    };
+
+    Window windows[SAMPLING_STATISTICS_WINDOWS];
+    std::atomic<uint32_t> current {0};      // window being recorded
+    uint32_t samplesPerWindow;
+    uint32_t windowSamples;
+    std::atomic<uint64_t> samples {0};
+
+public:
+    /// @brief Create the statistics
+    /// @param samplesPerWindow the number of samples of a window
+    SamplingStatistics(uint32_t samplesPerWindow);
+
+    /// @brief Record a sample (from one thread at a time)
+    void record(const SampleTiming& timing);
+
+    SamplingStatsSnapshot snapshot() const;
+};
+
+#endif // SAMPLING_STATISTICS_H_
@@ -0,0 +1,91 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENSOR_BUS_H_
+#define SENSOR_BUS_H_
+
+#include <cstdint>
+#include "bus_statistics.h"
+#include "register_shadow.h"
+
+#define SENSOR_BUS_MAX_BATCH_SIZE 32    // must stay below I2C_RDWR_IOCTL_MAX_MSGS (42)
+
+/// @brief A single register write, laid out as it is sent on the wire
+struct RegisterWrite {
+    uint8_t reg;
+    uint8_t value;
+};
+
+/// @brief Wire interface of the sensor, the bme68x driver addresses the registers differently on SPI
+enum class SensorBusInterface: uint8_t {
+    I2C = 0,
+    SPI = 1
+};
+
+/*
+    Register level access to a sensor, whatever is behind it (real bus, simulation...)
+*/
+
+class SensorBus {
+protected:
+    RegisterShadow shadow;
+    BusStatistics stats;
+
+public:
+    virtual ~SensorBus() {}
+
+    /// @brief Write data to the device
+    /// @param reg_addr the register address to write to
+    /// @param reg_data_ptr the data to write
+    /// @param data_len the length of the data to write
+    /// @return the number of bytes written or a negative value if an error occurred
+    virtual int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) = 0;
+
+    /// @brief Write several registers in a single transaction
+    /// @param writes the register/value pairs to write
+    /// @param count the number of pairs (at most SENSOR_BUS_MAX_BATCH_SIZE)
+    /// @return the number of registers written or a negative value if an error occurred
+    virtual int writeRegisters(const RegisterWrite *writes, uint32_t count) = 0;
+
+    /// @brief Read data from the device
+    /// @param reg_addr the register address to read from
+    /// @param reg_data_ptr the buffer to store the data
+    /// @param data_len the length of the data to read
+    /// @return the number of bytes read or a negative value if an error occurred
+    virtual int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) = 0;
+
+    /// @brief Check if the bus is ready to be used
+    virtual bool isOpened() = 0;
+
+    /// @brief Interface the register addresses are given for
+    virtual SensorBusInterface busInterface() {
+        return SensorBusInterface::I2C;
+    }
+
+    /// @brief Shadow of the written registers, used by hardware buses to elide redundant writes (disabled by default)
+    virtual RegisterShadow& registerShadow() {
+        return shadow;
+    }
+
+    /// @brief Latency, byte and error counters of the hardware transactions
+    virtual BusStatistics& statistics() {
+        return stats;
+    }
+};
+
+#endif // SENSOR_BUS_H_
@@ -0,0 +1,80 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENSOR_BUS_POLICY_H_
+#define SENSOR_BUS_POLICY_H_
+
+#include <cstdint>
+#include "sensor_bus.h"
+#include "bme68x_defs.h"
+
+/*
+    Register access of the bme68x driver bound at compile time to a bus type.
+    The bus classes are final: once instantiated for one of them, the calls below are resolved
+    statically and can be inlined down to the transfer, only the C callbacks given to the driver
+    stay indirect. SensorBus itself is the policy of buses only known at runtime (virtual calls).
+*/
+
+template <typename Bus>
+struct SensorBusPolicy {
+    /// @brief Read registers of the sensor
+    /// @param bus the bus of the sensor
+    /// @param reg_addr the register address to read from
+    /// @param reg_data_ptr the buffer to store the data
+    /// @param data_len the length of the data to read
+    /// @return 0 or -1 if an error occurred
+    static inline int8_t read(Bus& bus, uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+        return (bus.readData(reg_addr, reg_data_ptr, data_len) < 0) ? -1 : 0;
+    }
+
+    /// @brief Write registers of the sensor
+    /// @param bus the bus of the sensor
+    /// @param reg_addr the first register address to write to
+    /// @param reg_data_ptr the data to write, as given by the bme68x driver
+    /// @param data_len the length of the data to write
+    /// @return 0 or -1 if an error occurred
+    static inline int8_t write(Bus& bus, uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+        // The bme68x driver interleaves registers and values (reg_addr, value0, reg1, value1, ...),
+        // so an odd data_len is a list of register writes we can send as a single batch.
+        uint32_t count = (data_len + 1) / 2;
+        if (data_len % 2 == 1 && count <= SENSOR_BUS_MAX_BATCH_SIZE) {
+            RegisterWrite writes[SENSOR_BUS_MAX_BATCH_SIZE];
+            writes[0] = RegisterWrite{reg_addr, reg_data_ptr[0]};
+            for (uint32_t i = 1; i < count; ++i) {
+                writes[i] = RegisterWrite{reg_data_ptr[2 * i - 1], reg_data_ptr[2 * i]};
+            }
+            bool reset = false;
+            for (uint32_t i = 0; i < count; ++i) {
+                reset = reset || writes[i].reg == BME68X_REG_SOFT_RESET;
+            }
+            // a soft reset brings every register back to its default value: the shadow forgets
+            // them before the batch, and the values the batch committed before the reset after it
+            if (reset) {
+                bus.registerShadow().invalidate();
+            }
+            int ret = bus.writeRegisters(writes, count);
+            if (reset) {
+                bus.registerShadow().invalidate();
+            }
+            return (ret < 0) ? -1 : 0;
+        }
+        return (bus.writeData(reg_addr, reg_data_ptr, data_len) < 0) ? -1 : 0;
+    }
+};
+
+#endif // SENSOR_BUS_POLICY_H_
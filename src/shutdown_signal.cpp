@@ -0,0 +1,113 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "shutdown_signal.h"
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+ShutdownSignal::ShutdownSignal() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signalFd < 0) {
+        spdlog::error("[ShutdownSignal] Failed to create the signalfd: {}", strerror(errno));
+    }
+    doneFd = eventfd(0, EFD_CLOEXEC);
+    if (doneFd < 0) {
+        spdlog::error("[ShutdownSignal] Failed to create the eventfd: {}", strerror(errno));
+    }
+}
+
+ShutdownSignal::~ShutdownSignal() {
+    stop();
+    if (signalFd >= 0) {
+        close(signalFd);
+    }
+    if (doneFd >= 0) {
+        close(doneFd);
+    }
+}
+
+void ShutdownSignal::start(std::function<void()> onShutdown, int timeout) {
+    if (signalFd < 0 || doneFd < 0 || signalThread.joinable()) {
+        return;
+    }
+    signalThread = thread(&ShutdownSignal::run, this, onShutdown, timeout);
+}
+
+void ShutdownSignal::stop() {
+    if (!signalThread.joinable()) {
+        return;
+    }
+    uint64_t done = 1;
+    if (write(doneFd, &done, sizeof(done)) < 0) {
+        spdlog::error("[ShutdownSignal] Failed to stop: {}", strerror(errno));
+    }
+    signalThread.join();
+}
+
+/**********************************************************************************************************************/
+/* ShutdownSignal Private Implementation */
+/**********************************************************************************************************************/
+
+void ShutdownSignal::run(std::function<void()> onShutdown, int timeout) {
+    bool shuttingDown = false;
+    struct pollfd fds[2] = {{signalFd, POLLIN, 0}, {doneFd, POLLIN, 0}};
+    while (true) {
+        int ret = poll(fds, 2, shuttingDown ? timeout * 1000 : -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            spdlog::error("[ShutdownSignal] Failed to wait for the signals: {}", strerror(errno));
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+        if (ret == 0) {
+            spdlog::critical("[ShutdownSignal] The shutdown didn't complete within {} seconds, exiting", timeout);
+            spdlog::shutdown();
+            _exit(EXIT_FAILURE);
+        }
+
+        struct signalfd_siginfo info;
+        if (read(signalFd, &info, sizeof(info)) != sizeof(info)) {
+            continue;
+        }
+        if (shuttingDown) {
+            spdlog::critical("[ShutdownSignal] {} received again, exiting", strsignal(info.ssi_signo));
+            spdlog::shutdown();
+            _exit(EXIT_FAILURE);
+        }
+        spdlog::info("[ShutdownSignal] {} received, shutting down", strsignal(info.ssi_signo));
+        shuttingDown = true;
+        onShutdown();
+    }
+}
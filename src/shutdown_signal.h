@@ -0,0 +1,56 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHUTDOWN_SIGNAL_H_
+#define SHUTDOWN_SIGNAL_H_
+
+#include <functional>
+#include <thread>
+
+/*
+    Graceful shutdown on SIGTERM (systemd) and SIGINT: the signals are blocked in every thread
+    and read from a signalfd by a thread of their own, which runs the shutdown callback outside
+    of any signal handler. If the shutdown doesn't complete within its timeout, or a second
+    signal comes, the process exits at once.
+*/
+
+class ShutdownSignal {
+private:
+    int signalFd;
+    int doneFd;                             // eventfd telling the thread the shutdown completed
+    std::thread signalThread;
+
+    void run(std::function<void()> onShutdown, int timeout);
+
+public:
+    /// @brief Block SIGTERM and SIGINT (must be created before any other thread, which inherit the mask)
+    ShutdownSignal();
+    ~ShutdownSignal();
+    ShutdownSignal(const ShutdownSignal&) = delete;
+    void operator=(const ShutdownSignal&) = delete;
+
+    /// @brief Wait for the signals
+    /// @param onShutdown called on the first signal, to make the program stop
+    /// @param timeout seconds the program has to stop after the first signal
+    void start(std::function<void()> onShutdown, int timeout);
+
+    /// @brief Tell the shutdown completed (or the program ended on its own), the process won't be forced to exit
+    void stop();
+};
+
+#endif // SHUTDOWN_SIGNAL_H_
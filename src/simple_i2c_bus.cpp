@@ -18,21 +18,31 @@
 
 #include "simple_i2c_bus.h"
 #include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 extern "C"
 {
+    #include <linux/i2c.h>
     #include <linux/i2c-dev.h>
-    #include <i2c/smbus.h>
 }
 
-SimpleI2CBus::SimpleI2CBus() {
+static uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+SimpleI2CBus::SimpleI2CBus(): generation(0), jitter(std::random_device{}()) {
     spdlog::debug("[SimpleI2CBus] init");
     device = "";
-    slaveAddress = 0;
     busfd = -1;
+    failedReopens = 0;
+    muxAddress = I2C_BUS_TCA9548A_ADDRESS;
+    selectedChannel = -1;
 }
 
 SimpleI2CBus::~SimpleI2CBus() {
@@ -41,83 +51,295 @@ SimpleI2CBus::~SimpleI2CBus() {
 }
 
 bool SimpleI2CBus::isOpened() {
+    std::lock_guard<std::mutex> lock(busMutex);
     return busfd != -1;
 }
 
-int SimpleI2CBus::openI2CBus(std::string device, uint8_t slaveAddress) {
-    spdlog::debug("[SimpleI2CBus] openI2CBus: device={}, slaveAddress={}", device, slaveAddress);
-    // Open the I2C bus
+int SimpleI2CBus::openI2CBus(std::string device) {
+    spdlog::debug("[SimpleI2CBus] openI2CBus: device={}", device);
+    std::lock_guard<std::mutex> lock(busMutex);
+    this->device = device;
+    failedReopens = 0;
+    if (openAdapter() < 0) {
+        this->device = "";
+        return -1;
+    }
+    spdlog::info("[SimpleI2CBus] I2C bus opened");
+    return busfd;
+}
+
+void SimpleI2CBus::closeI2CBus() {
+    std::lock_guard<std::mutex> lock(busMutex);
+    dropConnection();
+    // explicitly closed: don't reopen it
+    device = "";
+}
+
+void SimpleI2CBus::setMultiplexerAddress(uint8_t address) {
+    std::lock_guard<std::mutex> lock(busMutex);
+    muxAddress = address;
+    selectedChannel = -1;
+}
+
+std::unique_ptr<I2CDevice> SimpleI2CBus::attachDevice(uint8_t slaveAddress, int muxChannel) {
+    if (muxChannel != I2C_BUS_NO_MUX_CHANNEL && (muxChannel < 0 || muxChannel >= I2C_BUS_MUX_CHANNELS)) {
+        spdlog::error("[SimpleI2CBus] Invalid multiplexer channel {} for the device {:#x} (0-{})", muxChannel, slaveAddress, I2C_BUS_MUX_CHANNELS - 1);
+        return nullptr;
+    }
+    return std::make_unique<I2CDevice>(this, slaveAddress, muxChannel);
+}
+
+uint32_t SimpleI2CBus::connectionGeneration() {
+    return generation.load(std::memory_order_acquire);
+}
+
+int SimpleI2CBus::transfer(struct i2c_msg *messages, uint32_t n_messages, int muxChannel, bool read, uint32_t bytes, BusStatistics& stats) {
+    struct i2c_rdwr_ioctl_data transfer;
+    transfer.msgs = messages;
+    transfer.nmsgs = n_messages;
+
+    std::lock_guard<std::mutex> lock(busMutex);
+
+    // A failed transfer is retried once on a freshly reopened bus, so a transient
+    // glitch costs a reopen instead of an error reported to the driver.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool reopening = busfd < 0;
+        if (!ensureOpened()) {
+            spdlog::error("[SimpleI2CBus] Failed to access the i2c bus: bus not open");
+            read ? stats.recordReadError(EBADF) : stats.recordWriteError(EBADF);
+            return -1;
+        }
+        if (reopening) {
+            stats.recordReopen();
+        }
+
+        if (muxChannel != I2C_BUS_NO_MUX_CHANNEL && muxChannel != selectedChannel && selectChannel(muxChannel, stats) < 0) {
+            spdlog::error("[SimpleI2CBus] Failed to select the multiplexer channel {}: {}", muxChannel, strerror(errno));
+            stats.recordClose();
+            dropConnection();
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int ret = ioctl(busfd, I2C_RDWR, &transfer);
+        int error = (ret < 0) ? errno : 0;
+        read ? stats.recordRead(elapsedUs(start), bytes, error) : stats.recordWrite(elapsedUs(start), bytes, error);
+        if (ret >= 0) {
+            return ret;
+        }
+
+        spdlog::error("[SimpleI2CBus] Failed to {} the i2c bus (address {:#x}): {}", read ? "read from" : "write to", messages[0].addr, strerror(error));
+        stats.recordClose();
+        dropConnection();
+    }
+    return -1;
+}
+
+/**********************************************************************************************************************/
+/* SimpleI2CBus Private Implementation */
+/**********************************************************************************************************************/
+
+int SimpleI2CBus::openAdapter() {
     int busfd = 0;
     if ((busfd = open(device.c_str(), O_RDWR)) < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to open the i2c bus");
+        spdlog::error("[SimpleI2CBus] Failed to open the i2c bus: {}", strerror(errno));
         return -1;
     }
 
-    // Specify the I2C slave address using an ioctl call
-    if (ioctl(busfd, I2C_SLAVE, slaveAddress) < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to acquire bus access or talk to slave");
+    // Devices are addressed per message: the adapter must support plain I2C transfers
+    unsigned long funcs = 0;
+    if (ioctl(busfd, I2C_FUNCS, &funcs) < 0 || !(funcs & I2C_FUNC_I2C)) {
+        spdlog::error("[SimpleI2CBus] The i2c adapter doesn't support combined transfers");
         close(busfd);
         return -1;
     }
 
-    this->device = device;
-    this->slaveAddress = slaveAddress;
     this->busfd = busfd;
-    spdlog::info("[SimpleI2CBus] I2C bus opened");
-
     return busfd;
 }
 
-void SimpleI2CBus::closeI2CBus() {
-    close(busfd);
+int SimpleI2CBus::selectChannel(int channel, BusStatistics& stats) {
+    // The TCA9548A only enables a channel after a STOP: the switch can't be merged in the transaction
+    uint8_t control = 1 << channel;
+    struct i2c_msg message;
+    message.addr = muxAddress;
+    message.flags = 0;
+    message.len = 1;
+    message.buf = &control;
+
+    struct i2c_rdwr_ioctl_data transfer;
+    transfer.msgs = &message;
+    transfer.nmsgs = 1;
+
+    auto start = std::chrono::steady_clock::now();
+    int ret = ioctl(busfd, I2C_RDWR, &transfer);
+    stats.recordWrite(elapsedUs(start), 1, (ret < 0) ? errno : 0);
+    stats.recordMuxSwitch();
+    selectedChannel = (ret < 0) ? -1 : channel;
+    return ret;
+}
+
+bool SimpleI2CBus::ensureOpened() {
+    if (busfd >= 0) {
+        return true;
+    }
+    if (device.empty() || std::chrono::steady_clock::now() < nextReopen) {
+        return false;
+    }
+
+    if (openAdapter() >= 0) {
+        spdlog::info("[SimpleI2CBus] I2C bus reopened after {} failed attempts", failedReopens);
+        failedReopens = 0;
+        return true;
+    }
+
+    // Exponential backoff with jitter: wait a random delay in [backoff / 2, backoff]
+    uint32_t shift = std::min<uint32_t>(failedReopens, 16);
+    uint64_t backoff_ms = std::min<uint64_t>((uint64_t)I2C_BUS_REOPEN_MIN_BACKOFF_MS << shift, I2C_BUS_REOPEN_MAX_BACKOFF_MS);
+    uint64_t delay_us = backoff_ms * 500 + jitter() % (backoff_ms * 500 + 1);
+    nextReopen = std::chrono::steady_clock::now() + std::chrono::microseconds(delay_us);
+    ++failedReopens;
+    spdlog::warn("[SimpleI2CBus] Failed to reopen the i2c bus, next attempt in {}us", delay_us);
+    return false;
+}
+
+void SimpleI2CBus::dropConnection() {
+    if (busfd >= 0) {
+        close(busfd);
+    }
     busfd = -1;
+    // the devices may be reset or replaced before the bus is opened again
+    generation.fetch_add(1, std::memory_order_release);
+    selectedChannel = -1;
+    // the first reopen attempt is immediate
+    nextReopen = std::chrono::steady_clock::now();
 }
 
-int SimpleI2CBus::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
-    if (busfd < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to write to the i2c bus: bus not open");
-        return -1;
+/**********************************************************************************************************************/
+/* I2CDevice */
+/**********************************************************************************************************************/
+
+I2CDevice::I2CDevice(SimpleI2CBus *bus, uint8_t slaveAddress, int muxChannel): bus(bus), slaveAddress(slaveAddress), muxChannel(muxChannel) {
+    generation = bus->connectionGeneration();
+}
+
+bool I2CDevice::isOpened() {
+    return bus->isOpened();
+}
+
+uint8_t I2CDevice::address() {
+    return slaveAddress;
+}
+
+int I2CDevice::channel() {
+    return muxChannel;
+}
+
+void I2CDevice::checkConnection() {
+    uint32_t current = bus->connectionGeneration();
+    if (current != generation) {
+        shadow.invalidate();
+        generation = current;
     }
+}
 
+int I2CDevice::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
     if (data_len + 1 > I2C_BUS_MAX_BUFFER_SIZE) {
         spdlog::error("[SimpleI2CBus] Failed to write to the i2c bus: buffer not big enough for data len: {}", data_len);
-        closeI2CBus();
         return -1;
     }
 
+    // Burst writes are not tracked by the shadow
+    checkConnection();
+    shadow.invalidate(reg_addr, data_len);
+
     // We need to write the register address first
     uint8_t buffer[I2C_BUS_MAX_BUFFER_SIZE];
-    memset(buffer, 0, sizeof(buffer));
     buffer[0] = reg_addr;
     memcpy(buffer + 1, reg_data_ptr, data_len);
 
-    int ret;
-    ret = write(busfd, buffer, data_len + 1);
-    if (ret < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to write to the i2c bus");
-        closeI2CBus();
-    }    
+    struct i2c_msg message;
+    message.addr = slaveAddress;
+    message.flags = 0;
+    message.len = data_len + 1;
+    message.buf = buffer;
 
-    return ret;
+    if (bus->transfer(&message, 1, muxChannel, false, data_len + 1, stats) < 0) {
+        return -1;
+    }
+    return data_len + 1;
 }
 
-int SimpleI2CBus::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
-	int ret;
+int I2CDevice::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    static_assert(sizeof(RegisterWrite) == 2, "RegisterWrite must be sent as is on the wire");
 
-    // Select the register to read from by writing its address
-    ret = i2c_smbus_write_byte(busfd, reg_addr);
-    if (ret < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to select register");
-        closeI2CBus();
-        return ret;
+    if (count > SENSOR_BUS_MAX_BATCH_SIZE) {
+        spdlog::error("[SimpleI2CBus] Failed to write to the i2c bus: too many registers in batch: {}", count);
+        return -1;
     }
 
-    ret = read(busfd, reg_data_ptr, data_len);
-    if (ret < 0) {
-        spdlog::error("[SimpleI2CBus] Failed to read from the i2c bus");        
-        closeI2CBus();
-        return ret;
+    // The sensor takes any number of register/value pairs in a single write: the whole batch
+    // is one message, with one start and one address byte. Writes the device already holds are left out.
+    checkConnection();
+    RegisterWrite buffer[SENSOR_BUS_MAX_BATCH_SIZE];
+    uint32_t n_writes = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!shadow.canElideWrite(writes[i].reg, writes[i].value)) {
+            buffer[n_writes++] = writes[i];
+        }
     }
 
-    return ret;
+    if (n_writes == 0) {
+        return count;
+    }
+
+    struct i2c_msg message;
+    message.addr = slaveAddress;
+    message.flags = 0;
+    message.len = n_writes * sizeof(RegisterWrite);
+    message.buf = reinterpret_cast<uint8_t*>(buffer);
+
+    // the shadow only learns the values once the device holds them, and forgets the
+    // registers of a failed batch: some of them may have been written
+    if (bus->transfer(&message, 1, muxChannel, false, n_writes * sizeof(RegisterWrite), stats) < 0) {
+        for (uint32_t i = 0; i < count; ++i) {
+            shadow.invalidate(writes[i].reg, 1);
+        }
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        shadow.commitWrite(writes[i].reg, writes[i].value);
+    }
+    return count;
+}
+
+int I2CDevice::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+    // the length of an i2c message is 16 bits wide
+    if (data_len > UINT16_MAX) {
+        spdlog::error("[SimpleI2CBus] Failed to read from the i2c bus: data len too large: {}", data_len);
+        return -1;
+    }
+
+    checkConnection();
+    if (shadow.read(reg_addr, reg_data_ptr, data_len)) {
+        return data_len;
+    }
+
+    // Select the register and read it back in a single combined transaction:
+    // the data read follows the register write with a repeated start, so no
+    // other bus user can slip in between and only one syscall is needed.
+    struct i2c_msg messages[2];
+    messages[0].addr = slaveAddress;
+    messages[0].flags = 0;
+    messages[0].len = 1;
+    messages[0].buf = &reg_addr;
+    messages[1].addr = slaveAddress;
+    messages[1].flags = I2C_M_RD;
+    messages[1].len = data_len;
+    messages[1].buf = reg_data_ptr;
+
+    if (bus->transfer(messages, 2, muxChannel, true, data_len, stats) < 0) {
+        return -1;
+    }
+    return data_len;
 }
@@ -19,20 +19,50 @@
 #ifndef SIMPLE_I2C_BUS_H_
 #define SIMPLE_I2C_BUS_H_
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include "sensor_bus.h"
+
+struct i2c_msg;
 
 #define I2C_BUS_MAX_BUFFER_SIZE 64
+#define I2C_BUS_REOPEN_MIN_BACKOFF_MS 1         // delay before the second reopen attempt (the first one is immediate)
+#define I2C_BUS_REOPEN_MAX_BACKOFF_MS 5000      // upper bound of the reopen delay
+#define I2C_BUS_TCA9548A_ADDRESS 0x70           // default address of a TCA9548A multiplexer
+#define I2C_BUS_NO_MUX_CHANNEL -1               // device directly on the bus, not behind the multiplexer
+#define I2C_BUS_MUX_CHANNELS 8                  // channels of the TCA9548A multiplexer (0-7)
+
+class I2CDevice;
 
 /*
-    Simple class to read and write data to an I2C device on a RPI
+    Simple class to read and write data to the I2C devices of a RPI bus.
+    The adapter is opened once and shared by all the devices, each message carries
+    its slave address (I2C_RDWR) and transfers are serialized internally.
+    Devices can sit behind a TCA9548A multiplexer: the selected channel is cached
+    and only switched when a transfer targets a device on another channel.
 */
 
 class SimpleI2CBus {
 private:
     std::string device;
-    uint8_t slaveAddress;
     int busfd;
+    std::mutex busMutex;
+    std::atomic<uint32_t> generation;       // incremented each time the connection is dropped
+    uint32_t failedReopens;
+    std::chrono::steady_clock::time_point nextReopen;
+    std::minstd_rand jitter;
+    uint8_t muxAddress;
+    int selectedChannel;                    // multiplexer channel currently enabled, -1 if unknown
+
+    int openAdapter();
+    int selectChannel(int channel, BusStatistics& stats);
+    bool ensureOpened();
+    void dropConnection();
 
 public:
     SimpleI2CBus();
@@ -40,27 +70,80 @@ public:
 
     /// @brief Open a file descriptor to an I2C bus
     /// @param device the device to open (something like "/dev/i2c-1")
-    /// @param slaveAddress the I2C slave address (something like 0x76 or 0x77)
     /// @return the file descriptor or -1 if an error occurred
-    int openI2CBus(std::string device, uint8_t slaveAddress);
+    int openI2CBus(std::string device);
 
     /// @brief Close the file descriptor to the I2C bus
+    /// A bus closed after a failed transfer is reopened automatically (with exponential backoff)
+    /// on the next transfer, a bus closed with this method stays closed.
     void closeI2CBus();
 
+    /// @brief Check if the I2C bus is opened
+    bool isOpened();
+
+    /// @brief Set the address of the TCA9548A multiplexer (I2C_BUS_TCA9548A_ADDRESS by default)
+    void setMultiplexerAddress(uint8_t address);
+
+    /// @brief Get a handle to a device of the bus (the bus must outlive it)
+    /// @param slaveAddress the I2C slave address (something like 0x76 or 0x77)
+    /// @param muxChannel the multiplexer channel of the device (0-7) or I2C_BUS_NO_MUX_CHANNEL
+    /// @return the device, nullptr if the channel is out of range
+    std::unique_ptr<I2CDevice> attachDevice(uint8_t slaveAddress, int muxChannel = I2C_BUS_NO_MUX_CHANNEL);
+
+    /// @brief Run a combined I2C_RDWR transaction, reopening the bus and switching the multiplexer if needed
+    /// @param messages the messages of the transaction
+    /// @param n_messages the number of messages
+    /// @param muxChannel the multiplexer channel of the target device or I2C_BUS_NO_MUX_CHANNEL
+    /// @param read true for a read transaction (for statistics)
+    /// @param bytes the number of payload bytes (for statistics)
+    /// @param stats the statistics to update
+    /// @return a negative value if an error occurred
+    int transfer(struct i2c_msg *messages, uint32_t n_messages, int muxChannel, bool read, uint32_t bytes, BusStatistics& stats);
+
+    /// @brief Number of times the connection has been dropped, device handles forget what they know about
+    /// the device when it changes
+    uint32_t connectionGeneration();
+};
+
+/*
+    Lightweight handle to one device of a SimpleI2CBus
+*/
+
+class I2CDevice final: public SensorBus {
+private:
+    SimpleI2CBus *bus;
+    uint8_t slaveAddress;
+    int muxChannel;
+    uint32_t generation;
+
+    void checkConnection();
+
+public:
+    I2CDevice(SimpleI2CBus *bus, uint8_t slaveAddress, int muxChannel);
+
     /// @brief Write data to an I2C device
     /// @param reg_addr the register address to write to
     /// @param reg_data_ptr the data to write
     /// @param data_len the length of the data to write
-    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len);
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+
+    /// @brief Write several registers in a single I2C message of interleaved register/value pairs
+    /// @param writes the register/value pairs to write
+    /// @param count the number of pairs (at most SENSOR_BUS_MAX_BATCH_SIZE)
+    /// @return the number of registers written or -1 if an error occurred
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
 
     /// @brief Read data from an I2C device
     /// @param reg_addr the register address to read from
     /// @param reg_data_ptr the buffer to store the data
     /// @param data_len the length of the data to read
-    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len);
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
 
     /// @brief Check if the I2C bus is opened
-    bool isOpened();
+    bool isOpened() override;
+
+    uint8_t address();
+    int channel();
 };
 
 #endif // SIMPLE_I2C_BUS_H_
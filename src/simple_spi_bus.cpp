@@ -0,0 +1,230 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simple_spi_bus.h"
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bme68x_defs.h"
+
+extern "C"
+{
+    #include <linux/spi/spidev.h>
+}
+
+#define SPI_BUS_PAGE_SIZE 0x80
+
+static uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+SimpleSPIBus::SimpleSPIBus() {
+    spdlog::debug("[SimpleSPIBus] init");
+    device = "";
+    busfd = -1;
+    speedHz = SPI_BUS_DEFAULT_SPEED_HZ;
+    memPage = 0;
+}
+
+SimpleSPIBus::~SimpleSPIBus() {
+    spdlog::debug("[SimpleSPIBus] deinit");
+    closeSPIBus();
+}
+
+bool SimpleSPIBus::isOpened() {
+    return busfd != -1;
+}
+
+SensorBusInterface SimpleSPIBus::busInterface() {
+    return SensorBusInterface::SPI;
+}
+
+int SimpleSPIBus::openSPIBus(std::string device, uint32_t speedHz) {
+    spdlog::debug("[SimpleSPIBus] openSPIBus: device={}, speed={}Hz", device, speedHz);
+    int busfd = 0;
+    if ((busfd = open(device.c_str(), O_RDWR)) < 0) {
+        spdlog::error("[SimpleSPIBus] Failed to open the spi bus: {}", strerror(errno));
+        return -1;
+    }
+
+    // The BME68x samples on the rising edge with the clock idle low (mode 0), MSB first
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    if (ioctl(busfd, SPI_IOC_WR_MODE, &mode) < 0
+        || ioctl(busfd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+        || ioctl(busfd, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz) < 0) {
+        spdlog::error("[SimpleSPIBus] Failed to configure the spi bus: {}", strerror(errno));
+        close(busfd);
+        return -1;
+    }
+
+    this->device = device;
+    this->busfd = busfd;
+    this->speedHz = speedHz;
+    // page 0 is selected at power on, the driver reads the status register before switching anyway
+    memPage = 0;
+    shadow.invalidate();
+    spdlog::info("[SimpleSPIBus] SPI bus opened");
+    return busfd;
+}
+
+void SimpleSPIBus::closeSPIBus() {
+    if (busfd >= 0) {
+        close(busfd);
+    }
+    busfd = -1;
+}
+
+int SimpleSPIBus::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+    if (data_len + 1 > SPI_BUS_MAX_BUFFER_SIZE) {
+        spdlog::error("[SimpleSPIBus] Failed to write to the spi bus: buffer not big enough for data len: {}", data_len);
+        return -1;
+    }
+
+    uint8_t buffer[SPI_BUS_MAX_BUFFER_SIZE];
+    buffer[0] = reg_addr & BME68X_SPI_WR_MSK;
+    memcpy(buffer + 1, reg_data_ptr, data_len);
+
+    struct spi_ioc_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.tx_buf = (uintptr_t)buffer;
+    transfer.len = data_len + 1;
+
+    int ret = this->transfer(&transfer, 1, false, data_len + 1);
+    // The device executes the write as register/value pairs (there is no burst write on SPI):
+    // the shadow forgets them and the page switches and resets are followed
+    for (uint32_t i = 0; i < data_len; i += 2) {
+        uint8_t reg = (i == 0) ? reg_addr : reg_data_ptr[i - 1];
+        shadow.invalidate(registerAddress(reg), 1);
+        trackWrite(reg, reg_data_ptr[i]);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    return data_len + 1;
+}
+
+int SimpleSPIBus::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    static_assert(sizeof(RegisterWrite) == 2, "RegisterWrite must be sent as is on the wire");
+
+    if (count > SENSOR_BUS_MAX_BATCH_SIZE) {
+        spdlog::error("[SimpleSPIBus] Failed to write to the spi bus: too many registers in batch: {}", count);
+        return -1;
+    }
+
+    // The sensor takes any number of register/value pairs while CS is held low: the whole batch
+    // is a single transfer. Writes the device already holds are left out.
+    // (the shadow registers depend on the memory page in effect at each write of the batch)
+    RegisterWrite buffer[SENSOR_BUS_MAX_BATCH_SIZE];
+    uint8_t shadowRegs[SENSOR_BUS_MAX_BATCH_SIZE];
+    uint32_t n_writes = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        shadowRegs[i] = registerAddress(writes[i].reg);
+        if (!shadow.canElideWrite(shadowRegs[i], writes[i].value)) {
+            buffer[n_writes++] = RegisterWrite{(uint8_t)(writes[i].reg & BME68X_SPI_WR_MSK), writes[i].value};
+        }
+        trackWrite(writes[i].reg, writes[i].value);
+    }
+
+    if (n_writes == 0) {
+        return count;
+    }
+
+    struct spi_ioc_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.tx_buf = (uintptr_t)buffer;
+    transfer.len = n_writes * sizeof(RegisterWrite);
+
+    if (this->transfer(&transfer, 1, false, n_writes * sizeof(RegisterWrite)) < 0) {
+        // any of the pairs (page switches included) may have been clocked in: nothing the shadow knows can be trusted
+        shadow.invalidate();
+        return -1;
+    }
+    // the shadow only learns the values once the device holds them
+    for (uint32_t i = 0; i < count; ++i) {
+        shadow.commitWrite(shadowRegs[i], writes[i].value);
+    }
+    return count;
+}
+
+int SimpleSPIBus::readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) {
+    if (shadow.read(registerAddress(reg_addr), reg_data_ptr, data_len)) {
+        return data_len;
+    }
+
+    // The address byte and the data are clocked in the same CS frame: the device
+    // auto-increments the address until CS goes high.
+    uint8_t address = reg_addr | BME68X_SPI_RD_MSK;
+    struct spi_ioc_transfer transfers[2];
+    memset(transfers, 0, sizeof(transfers));
+    transfers[0].tx_buf = (uintptr_t)&address;
+    transfers[0].len = 1;
+    transfers[1].rx_buf = (uintptr_t)reg_data_ptr;
+    transfers[1].len = data_len;
+
+    if (transfer(transfers, 2, true, data_len) < 0) {
+        return -1;
+    }
+    return data_len;
+}
+
+/**********************************************************************************************************************/
+/* SimpleSPIBus Private Implementation */
+/**********************************************************************************************************************/
+
+uint8_t SimpleSPIBus::registerAddress(uint8_t spiAddress) {
+    uint8_t reg = spiAddress & BME68X_SPI_WR_MSK;
+    // the status register holding the page bit is mapped in both pages
+    if (reg == (BME68X_REG_MEM_PAGE & BME68X_SPI_WR_MSK)) {
+        return BME68X_REG_MEM_PAGE;
+    }
+    // page 1 (spi_mem_page set) maps 0x00-0x7F, page 0 maps 0x80-0xFF
+    return (memPage & BME68X_SPI_MEM_PAGE_MSK) ? reg : reg + SPI_BUS_PAGE_SIZE;
+}
+
+void SimpleSPIBus::trackWrite(uint8_t spiAddress, uint8_t value) {
+    uint8_t reg = registerAddress(spiAddress);
+    if (reg == BME68X_REG_MEM_PAGE) {
+        memPage = value & BME68X_SPI_MEM_PAGE_MSK;
+    } else if (reg == BME68X_REG_SOFT_RESET && value == BME68X_SOFT_RESET_CMD) {
+        // a soft reset brings every register back to its default value, page 0 included
+        shadow.invalidate();
+        memPage = 0;
+    }
+}
+
+int SimpleSPIBus::transfer(struct spi_ioc_transfer *transfers, uint32_t n_transfers, bool read, uint32_t bytes) {
+    if (busfd < 0) {
+        spdlog::error("[SimpleSPIBus] Failed to access the spi bus: bus not open");
+        read ? stats.recordReadError(EBADF) : stats.recordWriteError(EBADF);
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int ret = ioctl(busfd, SPI_IOC_MESSAGE(n_transfers), transfers);
+    int error = (ret < 0) ? errno : 0;
+    read ? stats.recordRead(elapsedUs(start), bytes, error) : stats.recordWrite(elapsedUs(start), bytes, error);
+    if (ret < 0) {
+        spdlog::error("[SimpleSPIBus] Failed to {} the spi bus: {}", read ? "read from" : "write to", strerror(error));
+    }
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLE_SPI_BUS_H_
+#define SIMPLE_SPI_BUS_H_
+
+#include <cstdint>
+#include <string>
+#include "sensor_bus.h"
+
+struct spi_ioc_transfer;
+
+#define SPI_BUS_DEFAULT_SPEED_HZ 8000000        // the BME68x SPI interface runs up to 10 MHz
+#define SPI_BUS_MAX_BUFFER_SIZE 64
+
+/*
+    Simple class to read and write the registers of a BME68x wired to a RPI SPI bus (spidev).
+    In SPI mode the sensor has 7 bit register addresses split in two memory pages, selected by
+    the spi_mem_page bit of the status register. The bme68x driver switches pages by itself,
+    the bus follows its writes to the status register so the register shadow is keyed by the
+    same full addresses as on I2C.
+*/
+
+class SimpleSPIBus final: public SensorBus {
+private:
+    std::string device;
+    int busfd;
+    uint32_t speedHz;
+    uint8_t memPage;                        // spi_mem_page bit of the status register
+
+    uint8_t registerAddress(uint8_t spiAddress);
+    void trackWrite(uint8_t spiAddress, uint8_t value);
+    int transfer(struct spi_ioc_transfer *transfers, uint32_t n_transfers, bool read, uint32_t bytes);
+
+public:
+    SimpleSPIBus();
+    ~SimpleSPIBus();
+
+    /// @brief Open a file descriptor to a SPI device
+    /// @param device the device to open (something like "/dev/spidev0.0")
+    /// @param speedHz the clock frequency of the transfers
+    /// @return the file descriptor or -1 if an error occurred
+    int openSPIBus(std::string device, uint32_t speedHz = SPI_BUS_DEFAULT_SPEED_HZ);
+
+    /// @brief Close the file descriptor to the SPI device
+    void closeSPIBus();
+
+    /// @brief Write data to the device in a single transfer
+    /// @param reg_addr the register address to write to (7 bit)
+    /// @param reg_data_ptr the data to write (register/value pairs after the first value)
+    /// @param data_len the length of the data to write
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+
+    /// @brief Write several registers in a single transfer (the pairs are clocked out back to back)
+    /// @param writes the register/value pairs to write
+    /// @param count the number of pairs (at most SENSOR_BUS_MAX_BATCH_SIZE)
+    /// @return the number of registers written or -1 if an error occurred
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
+
+    /// @brief Read data from the device
+    /// @param reg_addr the register address to read from (7 bit, with or without the read bit)
+    /// @param reg_data_ptr the buffer to store the data
+    /// @param data_len the length of the data to read
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
+
+    /// @brief Check if the SPI device is opened
+    bool isOpened() override;
+
+    SensorBusInterface busInterface() override;
+};
+
+#endif // SIMPLE_SPI_BUS_H_
@@ -0,0 +1,335 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simulated_bme68x_bus.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "bme68x_defs.h"
+
+using namespace std;
+
+#define SIMULATED_MODE_MSK 0x03
+#define SIMULATED_SPI_PAGE_SIZE 0x80
+
+namespace {
+
+// Calibration coefficients of the simulated sensor (typical BME688 values)
+struct Calibration {
+    uint16_t par_t1 = 26064;
+    int16_t par_t2 = 26378;
+    int8_t par_t3 = 3;
+    uint16_t par_p1 = 36442;
+    int16_t par_p2 = -10369;
+    int8_t par_p3 = 88;
+    int16_t par_p4 = 6917;
+    int16_t par_p5 = -131;
+    int8_t par_p6 = 30;
+    int8_t par_p7 = 39;
+    int16_t par_p8 = -2806;
+    int16_t par_p9 = -3096;
+    uint8_t par_p10 = 30;
+    uint16_t par_h1 = 750;
+    uint16_t par_h2 = 1020;
+    int8_t par_h3 = 0;
+    int8_t par_h4 = 45;
+    int8_t par_h5 = 20;
+    uint8_t par_h6 = 120;
+    int8_t par_h7 = -100;
+    int8_t par_gh1 = -30;
+    int16_t par_gh2 = -5969;
+    int8_t par_gh3 = 18;
+    uint8_t res_heat_range = 1;
+    int8_t res_heat_val = 48;
+    int8_t range_sw_err = 0;
+};
+
+const Calibration calib;
+
+// Same layout as the bme68x driver coefficient array (coeff1, then coeff2, then coeff3)
+void encodeCalibration(uint8_t coeff[BME68X_LEN_COEFF1 + BME68X_LEN_COEFF2 + BME68X_LEN_COEFF3]) {
+    memset(coeff, 0, BME68X_LEN_COEFF1 + BME68X_LEN_COEFF2 + BME68X_LEN_COEFF3);
+    coeff[0] = (uint16_t)calib.par_t2 & 0xFF;
+    coeff[1] = (uint16_t)calib.par_t2 >> 8;
+    coeff[2] = (uint8_t)calib.par_t3;
+    coeff[4] = calib.par_p1 & 0xFF;
+    coeff[5] = calib.par_p1 >> 8;
+    coeff[6] = (uint16_t)calib.par_p2 & 0xFF;
+    coeff[7] = (uint16_t)calib.par_p2 >> 8;
+    coeff[8] = (uint8_t)calib.par_p3;
+    coeff[10] = (uint16_t)calib.par_p4 & 0xFF;
+    coeff[11] = (uint16_t)calib.par_p4 >> 8;
+    coeff[12] = (uint16_t)calib.par_p5 & 0xFF;
+    coeff[13] = (uint16_t)calib.par_p5 >> 8;
+    coeff[14] = (uint8_t)calib.par_p7;
+    coeff[15] = (uint8_t)calib.par_p6;
+    coeff[18] = (uint16_t)calib.par_p8 & 0xFF;
+    coeff[19] = (uint16_t)calib.par_p8 >> 8;
+    coeff[20] = (uint16_t)calib.par_p9 & 0xFF;
+    coeff[21] = (uint16_t)calib.par_p9 >> 8;
+    coeff[22] = calib.par_p10;
+    coeff[23] = calib.par_h2 >> 4;
+    coeff[24] = ((calib.par_h2 & 0x0F) << 4) | (calib.par_h1 & 0x0F);
+    coeff[25] = calib.par_h1 >> 4;
+    coeff[26] = (uint8_t)calib.par_h3;
+    coeff[27] = (uint8_t)calib.par_h4;
+    coeff[28] = (uint8_t)calib.par_h5;
+    coeff[29] = calib.par_h6;
+    coeff[30] = (uint8_t)calib.par_h7;
+    coeff[31] = calib.par_t1 & 0xFF;
+    coeff[32] = calib.par_t1 >> 8;
+    coeff[33] = (uint16_t)calib.par_gh2 & 0xFF;
+    coeff[34] = (uint16_t)calib.par_gh2 >> 8;
+    coeff[35] = (uint8_t)calib.par_gh1;
+    coeff[36] = (uint8_t)calib.par_gh3;
+    coeff[37] = (uint8_t)calib.res_heat_val;
+    coeff[39] = calib.res_heat_range << 4;
+    coeff[41] = (uint8_t)(calib.range_sw_err << 4);
+}
+
+// Floating point compensation formulas of the bme68x driver, used to find the raw values to report
+double compensateTemperature(uint32_t temp_adc, double *t_fine) {
+    double var1 = ((temp_adc / 16384.0) - (calib.par_t1 / 1024.0)) * calib.par_t2;
+    double var2 = ((temp_adc / 131072.0) - (calib.par_t1 / 8192.0));
+    var2 = var2 * var2 * (calib.par_t3 * 16.0);
+    *t_fine = var1 + var2;
+    return *t_fine / 5120.0;
+}
+
+double compensatePressure(uint32_t pres_adc, double t_fine) {
+    double var1 = (t_fine / 2.0) - 64000.0;
+    double var2 = var1 * var1 * (calib.par_p6 / 131072.0);
+    var2 = var2 + (var1 * calib.par_p5 * 2.0);
+    var2 = (var2 / 4.0) + (calib.par_p4 * 65536.0);
+    var1 = (((calib.par_p3 * var1 * var1) / 16384.0) + (calib.par_p2 * var1)) / 524288.0;
+    var1 = (1.0 + (var1 / 32768.0)) * calib.par_p1;
+    double pressure = 1048576.0 - pres_adc;
+    pressure = ((pressure - (var2 / 4096.0)) * 6250.0) / var1;
+    var1 = (calib.par_p9 * pressure * pressure) / 2147483648.0;
+    var2 = pressure * (calib.par_p8 / 32768.0);
+    double var3 = (pressure / 256.0) * (pressure / 256.0) * (pressure / 256.0) * (calib.par_p10 / 131072.0);
+    return pressure + (var1 + var2 + var3 + (calib.par_p7 * 128.0)) / 16.0;
+}
+
+double compensateHumidity(uint32_t hum_adc, double t_fine) {
+    double temp_comp = t_fine / 5120.0;
+    double var1 = hum_adc - ((calib.par_h1 * 16.0) + ((calib.par_h3 / 2.0) * temp_comp));
+    double var2 = var1 * ((calib.par_h2 / 262144.0) * (1.0 + ((calib.par_h4 / 16384.0) * temp_comp) + ((calib.par_h5 / 1048576.0) * temp_comp * temp_comp)));
+    double var3 = calib.par_h6 / 16384.0;
+    double var4 = calib.par_h7 / 2097152.0;
+    return var2 + ((var3 + (var4 * temp_comp)) * var2 * var2);
+}
+
+// Find the raw value whose compensated value is the closest to target (compensate must be monotonic)
+template <typename Compensate>
+uint32_t findRawValue(Compensate compensate, double target, uint32_t max_adc) {
+    uint32_t low = 0;
+    uint32_t high = max_adc;
+    bool increasing = compensate(high) > compensate(low);
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        double value = compensate(middle);
+        if ((value < target) == increasing) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Inverse of the high gas variant formula: R = 1e6 * (262144 >> range) / (4096 + 3 * (adc - 512))
+void encodeGasResistance(double resistance, uint16_t *gas_adc, uint8_t *gas_range) {
+    for (uint8_t range = 0; range < 16; ++range) {
+        double var2 = 1000000.0 * (262144 >> range) / resistance;
+        if (var2 >= 4096.0 - 3 * 512 && var2 <= 4096.0 + 3 * 511) {
+            *gas_adc = (uint16_t)lround((var2 - 4096.0) / 3.0 + 512.0);
+            *gas_range = range;
+            return;
+        }
+    }
+    // out of the sensor range: saturate
+    *gas_adc = (resistance > 1000000.0) ? 0 : 1023;
+    *gas_range = (resistance > 1000000.0) ? 0 : 15;
+}
+
+}
+
+/**********************************************************************************************************************/
+/* SimulatedBME68xBus Public Implementation */
+/**********************************************************************************************************************/
+
+SimulatedBME68xBus::SimulatedBME68xBus(SimulatedBME68xConfig config, std::function<int64_t()> timestampUs)
+    : config(config), timestampUs(timestampUs), generator(config.seed) {
+    if (!this->timestampUs) {
+        this->timestampUs = []() {
+            return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        };
+    }
+    reset();
+    spdlog::info("[SimulatedBME68xBus] simulated sensor ready");
+}
+
+bool SimulatedBME68xBus::isOpened() {
+    return true;
+}
+
+SensorBusInterface SimulatedBME68xBus::busInterface() {
+    return config.spi ? SensorBusInterface::SPI : SensorBusInterface::I2C;
+}
+
+int SimulatedBME68xBus::writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) {
+    if (data_len == 0) {
+        return 0;
+    }
+    // Like the real device, a multi byte write is a list of register/value pairs
+    writeRegister(reg_addr, reg_data_ptr[0]);
+    for (uint32_t i = 1; i + 1 < data_len; i += 2) {
+        writeRegister(reg_data_ptr[i], reg_data_ptr[i + 1]);
+    }
+    return data_len + 1;
+}
+
+int SimulatedBME68xBus::writeRegisters(const RegisterWrite *writes, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        writeRegister(writes[i].reg, writes[i].value);
+    }
+    return count;
+}
+
+int SimulatedBME68xBus::readData(uint8_t address, uint8_t *reg_data_ptr, uint32_t data_len) {
+    uint8_t reg_addr = registerAddress(address);
+    if (reg_addr + data_len > sizeof(registers)) {
+        spdlog::error("[SimulatedBME68xBus] read out of the register map: reg={}, len={}", reg_addr, data_len);
+        return -1;
+    }
+    // In parallel mode the sensor keeps measuring: serve fresh fields on every data read
+    if (reg_addr == BME68X_REG_FIELD0 && (registers[BME68X_REG_CTRL_MEAS] & SIMULATED_MODE_MSK) == BME68X_PARALLEL_MODE) {
+        measure(BME68X_PARALLEL_MODE);
+    }
+    memcpy(reg_data_ptr, registers + reg_addr, data_len);
+    return data_len;
+}
+
+/**********************************************************************************************************************/
+/* SimulatedBME68xBus Private Implementation */
+/**********************************************************************************************************************/
+
+void SimulatedBME68xBus::reset() {
+    memset(registers, 0, sizeof(registers));
+    registers[BME68X_REG_CHIP_ID] = BME68X_CHIP_ID;
+    registers[BME68X_REG_VARIANT_ID] = BME68X_VARIANT_GAS_HIGH;
+
+    uint8_t coeff[BME68X_LEN_COEFF1 + BME68X_LEN_COEFF2 + BME68X_LEN_COEFF3];
+    encodeCalibration(coeff);
+    memcpy(registers + BME68X_REG_COEFF1, coeff, BME68X_LEN_COEFF1);
+    memcpy(registers + BME68X_REG_COEFF2, coeff + BME68X_LEN_COEFF1, BME68X_LEN_COEFF2);
+    memcpy(registers + BME68X_REG_COEFF3, coeff + BME68X_LEN_COEFF1 + BME68X_LEN_COEFF2, BME68X_LEN_COEFF3);
+
+    measureIndex = 0;
+    gasIndex = 0;
+}
+
+uint8_t SimulatedBME68xBus::registerAddress(uint8_t address) {
+    if (!config.spi) {
+        return address;
+    }
+    uint8_t reg = address & BME68X_SPI_WR_MSK;
+    // the status register is mapped in both pages
+    if (reg == (BME68X_REG_MEM_PAGE & BME68X_SPI_WR_MSK)) {
+        return BME68X_REG_MEM_PAGE;
+    }
+    return (registers[BME68X_REG_MEM_PAGE] & BME68X_SPI_MEM_PAGE_MSK) ? reg : reg + SIMULATED_SPI_PAGE_SIZE;
+}
+
+void SimulatedBME68xBus::writeRegister(uint8_t address, uint8_t value) {
+    uint8_t reg = registerAddress(address);
+    if (reg == BME68X_REG_SOFT_RESET) {
+        if (value == BME68X_SOFT_RESET_CMD) {
+            reset();
+        }
+        return;
+    }
+    registers[reg] = value;
+
+    if (reg == BME68X_REG_CTRL_MEAS && (value & SIMULATED_MODE_MSK) == BME68X_FORCED_MODE) {
+        // The conversion completes at once and the sensor goes back to sleep
+        measure(BME68X_FORCED_MODE);
+        registers[BME68X_REG_CTRL_MEAS] &= ~SIMULATED_MODE_MSK;
+    }
+}
+
+void SimulatedBME68xBus::measure(uint8_t mode) {
+    uint8_t nb_conv = registers[BME68X_REG_CTRL_GAS_1] & 0x0F;
+    if (mode == BME68X_FORCED_MODE) {
+        // nb_conv selects the heater set point in forced mode
+        writeField(0, nb_conv);
+        return;
+    }
+    // nb_conv is the heater profile length in parallel mode
+    for (uint8_t field = 0; field < BME68X_N_MEAS; ++field) {
+        writeField(field, gasIndex);
+        gasIndex = (nb_conv > 0) ? (gasIndex + 1) % nb_conv : 0;
+    }
+}
+
+void SimulatedBME68xBus::writeField(uint8_t field_index, uint8_t gas_index) {
+    double t = timestampUs() / 1000000.0;
+    double temperature = sample(config.temperature, t);
+    double pressure = sample(config.pressure, t);
+    double humidity = clamp(sample(config.humidity, t), 0.0, 100.0);
+    double gas_resistance = max(sample(config.gasResistance, t), 1.0);
+
+    double t_fine = 0;
+    uint32_t temp_adc = findRawValue([&](uint32_t adc) { return compensateTemperature(adc, &t_fine); }, temperature, 0xFFFFF);
+    compensateTemperature(temp_adc, &t_fine);
+    uint32_t pres_adc = findRawValue([&](uint32_t adc) { return compensatePressure(adc, t_fine); }, pressure, 0xFFFFF);
+    uint32_t hum_adc = findRawValue([&](uint32_t adc) { return compensateHumidity(adc, t_fine); }, humidity, 0xFFFF);
+    uint16_t gas_adc;
+    uint8_t gas_range;
+    encodeGasResistance(gas_resistance, &gas_adc, &gas_range);
+
+    uint8_t *field = registers + BME68X_REG_FIELD0 + field_index * BME68X_LEN_FIELD_OFFSET;
+    memset(field, 0, BME68X_LEN_FIELD);
+    field[0] = BME68X_NEW_DATA_MSK | (gas_index & 0x0F);
+    field[1] = measureIndex++;
+    field[2] = (pres_adc >> 12) & 0xFF;
+    field[3] = (pres_adc >> 4) & 0xFF;
+    field[4] = (pres_adc & 0x0F) << 4;
+    field[5] = (temp_adc >> 12) & 0xFF;
+    field[6] = (temp_adc >> 4) & 0xFF;
+    field[7] = (temp_adc & 0x0F) << 4;
+    field[8] = (hum_adc >> 8) & 0xFF;
+    field[9] = hum_adc & 0xFF;
+    field[15] = (gas_adc >> 2) & 0xFF;
+    field[16] = ((gas_adc & 0x03) << 6) | BME68X_GASM_VALID_MSK | BME68X_HEAT_STAB_MSK | gas_range;
+}
+
+double SimulatedBME68xBus::sample(const SimulatedWaveform& waveform, double t) {
+    double value = waveform.mean;
+    if (waveform.period > 0) {
+        value += waveform.amplitude * sin(2 * M_PI * t / waveform.period);
+    }
+    if (waveform.noise > 0) {
+        normal_distribution<double> noise(0.0, waveform.noise);
+        value += noise(generator);
+    }
+    return value;
+}
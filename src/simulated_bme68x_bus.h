@@ -0,0 +1,82 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMULATED_BME68X_BUS_H_
+#define SIMULATED_BME68X_BUS_H_
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include "sensor_bus.h"
+
+/// @brief A sine wave with gaussian noise: mean + amplitude * sin(2 * pi * t / period) + noise
+struct SimulatedWaveform {
+    double mean;
+    double amplitude;
+    double period;      // period in seconds
+    double noise;       // standard deviation of the noise
+};
+
+struct SimulatedBME68xConfig {
+    SimulatedWaveform temperature {23.0, 2.0, 86400.0, 0.02};           // Celsius
+    SimulatedWaveform humidity {45.0, 10.0, 86400.0, 0.2};              // %RH
+    SimulatedWaveform pressure {101325.0, 300.0, 86400.0 * 3, 2.0};     // Pa
+    SimulatedWaveform gasResistance {80000.0, 30000.0, 3600.0 * 6, 500.0}; // Ohm
+    uint32_t seed {42};                                                 // noise generator seed
+    bool spi {false};                                                   // SPI addressing (7 bit addresses in two memory pages)
+};
+
+/*
+    Software model of a BME688 register map.
+    Measurements complete as soon as they are triggered, with field data generated from the
+    configured waveforms and encoded with the model calibration coefficients, so the bme68x
+    driver compensates them back to the requested values.
+    In SPI mode the addresses are decoded like the real device does it, through the memory
+    page selected in the status register, so SimpleSPIBus users can be tested without hardware.
+*/
+
+class SimulatedBME68xBus final: public SensorBus {
+private:
+    SimulatedBME68xConfig config;
+    std::function<int64_t()> timestampUs;   // time source for the waveforms
+    std::mt19937 generator;
+    uint8_t registers[256];
+    uint8_t measureIndex;
+    uint8_t gasIndex;
+
+    void reset();
+    uint8_t registerAddress(uint8_t address);
+    void writeRegister(uint8_t address, uint8_t value);
+    void measure(uint8_t mode);
+    void writeField(uint8_t field, uint8_t gas_index);
+    double sample(const SimulatedWaveform& waveform, double t);
+
+public:
+    /// @brief Create a simulated sensor
+    /// @param config the waveforms of the simulated environment
+    /// @param timestampUs the time source driving the waveforms (steady clock if empty)
+    SimulatedBME68xBus(SimulatedBME68xConfig config, std::function<int64_t()> timestampUs = nullptr);
+
+    int writeData(uint8_t reg_addr, const uint8_t *reg_data_ptr, uint32_t data_len) override;
+    int writeRegisters(const RegisterWrite *writes, uint32_t count) override;
+    int readData(uint8_t reg_addr, uint8_t *reg_data_ptr, uint32_t data_len) override;
+    bool isOpened() override;
+    SensorBusInterface busInterface() override;
+};
+
+#endif // SIMULATED_BME68X_BUS_H_
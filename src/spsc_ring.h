@@ -0,0 +1,76 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define SPSC_RING_CACHE_LINE 64
+
+/*
+    Bounded lock-free queue between one producer and one consumer thread.
+    A full ring refuses the new element (drop newest) and counts it: the producer never waits.
+    Capacity must be a power of two.
+*/
+
+template<typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "the capacity of a SpscRing must be a power of two");
+
+private:
+    T elements[Capacity];
+    alignas(SPSC_RING_CACHE_LINE) std::atomic<size_t> head {0};    // next element to pop, written by the consumer
+    alignas(SPSC_RING_CACHE_LINE) std::atomic<size_t> tail {0};    // next element to push, written by the producer
+    std::atomic<uint64_t> drops {0};
+
+public:
+    /// @brief Push an element (producer thread)
+    /// @return false if the ring was full and the element dropped
+    bool push(const T& element) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity) {
+            drops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        elements[t & (Capacity - 1)] = element;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Pop the oldest element (consumer thread)
+    /// @return false if the ring was empty
+    bool pop(T& element) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        element = elements[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Number of elements dropped because the ring was full
+    uint64_t dropped() const {
+        return drops.load(std::memory_order_relaxed);
+    }
+};
+
+#endif // SPSC_RING_H_
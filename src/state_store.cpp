@@ -0,0 +1,174 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "state_store.h"
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// write all the bytes, retrying the partial and interrupted writes
+static bool writeAll(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// make the renames of a directory durable
+static void syncDirectory(const fs::path& directory) {
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    fsync(fd);
+    close(fd);
+}
+
+StateStore::StateStore(const std::string& path, unsigned int generations)
+    : path(path), generations(generations), known(false), knownLength(0), knownCrc(0) {
+    if (this->generations == 0) {
+        this->generations = 1;
+    }
+}
+
+int StateStore::save(const uint8_t *data, uint32_t length) {
+    // an unchanged state would only wear the SD card
+    uint32_t crc = crc32(data, length);
+    if (known && length == knownLength && crc == knownCrc) {
+        return STATE_STORE_UNCHANGED;
+    }
+
+    fs::path directory = fs::path(path).parent_path();
+    std::error_code error;
+    if (!directory.empty() && !fs::exists(directory, error)) {
+        spdlog::debug("[StateStore] State folder does not exist");
+        fs::create_directories(directory, error);
+    }
+
+    StateFileHeader header{STATE_STORE_MAGIC, STATE_STORE_VERSION, 0, length, crc};
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        spdlog::error("[StateStore] Failed to create {}: {}", temporary, strerror(errno));
+        return -1;
+    }
+    bool written = writeAll(fd, reinterpret_cast<const uint8_t*>(&header), sizeof(header)) && writeAll(fd, data, length) && fsync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+    if (!written) {
+        spdlog::error("[StateStore] Failed to write {}: {}", temporary, strerror(saved_errno));
+        unlink(temporary.c_str());
+        return -1;
+    }
+
+    // shift the generations, the oldest one is overwritten
+    for (unsigned int generation = generations - 1; generation > 0; --generation) {
+        std::string older = generationPath(generation - 1);
+        if (access(older.c_str(), F_OK) == 0 && rename(older.c_str(), generationPath(generation).c_str()) < 0) {
+            spdlog::warn("[StateStore] Failed to rotate {}: {}", older, strerror(errno));
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) < 0) {
+        spdlog::error("[StateStore] Failed to rename {}: {}", temporary, strerror(errno));
+        return -1;
+    }
+    syncDirectory(directory);
+    known = true;
+    knownLength = length;
+    knownCrc = crc;
+    return 0;
+}
+
+uint32_t StateStore::load(uint8_t *buffer, uint32_t size) {
+    for (unsigned int generation = 0; generation < generations; ++generation) {
+        std::string file = generationPath(generation);
+        uint32_t length = loadFile(file, buffer, size);
+        if (length > 0) {
+            if (generation > 0) {
+                spdlog::warn("[StateStore] Newer state generations are invalid, using {}", file);
+            } else {
+                known = true;
+                knownLength = length;
+                knownCrc = crc32(buffer, length);
+            }
+            return length;
+        }
+    }
+    return 0;
+}
+
+const std::string& StateStore::filePath() {
+    return path;
+}
+
+uint32_t StateStore::crc32(const uint8_t *data, uint32_t length) {
+    // CRC-32 (IEEE 802.3, reflected), bitwise: a few hundred bytes every few hours
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/**********************************************************************************************************************/
+/* StateStore Private Implementation */
+/**********************************************************************************************************************/
+
+std::string StateStore::generationPath(unsigned int generation) {
+    return (generation == 0) ? path : path + "." + std::to_string(generation);
+}
+
+uint32_t StateStore::loadFile(const std::string& file, uint8_t *buffer, uint32_t size) {
+    FILE *stream = fopen(file.c_str(), "rb");
+    if (stream == nullptr) {
+        return 0;
+    }
+    StateFileHeader header;
+    std::vector<uint8_t> data;
+    bool valid = fread(&header, sizeof(header), 1, stream) == 1
+        && header.magic == STATE_STORE_MAGIC && header.version == STATE_STORE_VERSION && header.length <= size;
+    if (valid) {
+        data.resize(header.length);
+        valid = fread(data.data(), 1, header.length, stream) == header.length && crc32(data.data(), header.length) == header.crc;
+    }
+    fclose(stream);
+    if (!valid) {
+        spdlog::warn("[StateStore] {} is not a valid state file", file);
+        return 0;
+    }
+    memcpy(buffer, data.data(), header.length);
+    return header.length;
+}
@@ -0,0 +1,79 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATE_STORE_H_
+#define STATE_STORE_H_
+
+#include <cstdint>
+#include <string>
+
+#define STATE_STORE_MAGIC 0x53514149        // "IAQS"
+#define STATE_STORE_VERSION 1
+#define STATE_STORE_UNCHANGED 1             // result of a save skipped because the state didn't change
+
+#pragma pack(push, 1)
+struct StateFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t length;                        // length of the state following the header
+    uint32_t crc;                           // CRC-32 of the state
+};
+#pragma pack(pop)
+
+/*
+    Crash-safe storage of a state blob (the BSEC state) in a few generations of files:
+    <path> is the newest one, <path>.1 the previous one... A save writes a temporary file,
+    fsyncs and renames it over <path> once the older generations are shifted, so a power cut
+    leaves at worst a stale temporary file. A load returns the newest generation whose
+    header and CRC are valid. A state identical to the newest generation is not written again.
+*/
+
+class StateStore {
+private:
+    std::string path;
+    unsigned int generations;
+    bool known;                             // the newest generation on disk is known (saved or loaded)
+    uint32_t knownLength;
+    uint32_t knownCrc;
+
+    std::string generationPath(unsigned int generation);
+    uint32_t loadFile(const std::string& file, uint8_t *buffer, uint32_t size);
+
+public:
+    /// @brief Create a store
+    /// @param path the file of the newest generation
+    /// @param generations the number of generations kept (1 at least)
+    StateStore(const std::string& path, unsigned int generations);
+
+    /// @brief Save a new generation of the state, unless it is the same as the newest one
+    /// @return 0, STATE_STORE_UNCHANGED if the state was already saved, or -1 if it couldn't be written (the previous generations are then untouched)
+    int save(const uint8_t *data, uint32_t length);
+
+    /// @brief Load the newest valid generation of the state
+    /// @param buffer the buffer to store the state
+    /// @param size its size
+    /// @return the length of the state, 0 if no generation is valid
+    uint32_t load(uint8_t *buffer, uint32_t size);
+
+    const std::string& filePath();
+
+    static uint32_t crc32(const uint8_t *data, uint32_t length);
+};
+
+#endif // STATE_STORE_H_
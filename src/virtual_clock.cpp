@@ -0,0 +1,46 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "virtual_clock.h"
+
+VirtualClock::VirtualClock(int64_t startNs): now(startNs) {
+}
+
+void VirtualClock::advanceTo(int64_t timeNs) {
+    // time never goes back, whichever thread advances it
+    int64_t current = now.load();
+    while (current < timeNs && !now.compare_exchange_weak(current, timeNs)) {
+    }
+}
+
+int64_t VirtualClock::nowNs() {
+    return now;
+}
+
+void VirtualClock::sleepUntilNs(int64_t deadlineNs) {
+    advanceTo(deadlineNs);
+}
+
+void VirtualClock::waitUntilNs(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, int64_t deadlineNs) {
+    // nothing else can happen before the deadline: it is reached at once
+    advanceTo(deadlineNs);
+}
+
+bool VirtualClock::isVirtual() {
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+* RPi IAQ Monitor
+* Copyright (C) 2024  Nicolas Mauri
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTUAL_CLOCK_H_
+#define VIRTUAL_CLOCK_H_
+
+#include <atomic>
+#include "sampling_clock.h"
+
+/*
+    Simulated time: sleeping and waiting advance it at once to their deadline instead of
+    blocking. With a simulated or replayed sensor, days of sampling run in seconds
+    while BSEC sees the same timestamps as in real time.
+*/
+
+class VirtualClock final : public SamplingClock {
+private:
+    std::atomic<int64_t> now;
+
+    void advanceTo(int64_t timeNs);
+
+public:
+    /// @brief Create a clock
+    /// @param startNs the initial time (nanoseconds)
+    VirtualClock(int64_t startNs);
+
+    int64_t nowNs() override;
+    void sleepUntilNs(int64_t deadlineNs) override;
+    void waitUntilNs(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, int64_t deadlineNs) override;
+    bool isVirtual() override;
+};
+
+#endif // VIRTUAL_CLOCK_H_